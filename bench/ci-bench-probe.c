@@ -0,0 +1,42 @@
+/* Run by the services of the benchmark configuration. Reports the call
+ * sequence number and the time it was started to ci-bench-server.
+ *
+ * usage: ci-bench-probe <completenumber>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+int main(int argc, char **argv)
+{
+    struct timespec now;
+    struct sockaddr_un addr;
+    char buffer[128];
+    const char *path = getenv("CI_BENCH_SOCKET");
+    int fd;
+    int len;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if (argc < 2 || path == NULL || strlen(path) >= sizeof(addr.sun_path))
+        return 1;
+
+    if ((fd = socket(AF_UNIX, SOCK_DGRAM, 0)) == -1)
+        return 1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    /* microseconds, comparable to g_get_monotonic_time() */
+    len = snprintf(buffer, sizeof(buffer), "%s %lld", argv[1],
+            (long long)now.tv_sec * 1000000LL + now.tv_nsec / 1000);
+    sendto(fd, buffer, len, 0, (struct sockaddr *)&addr, sizeof(addr));
+    close(fd);
+
+    return 0;
+}
@@ -0,0 +1,420 @@
+/* Load test for ciservice.
+ *
+ * Acts as a CallerInfo server: starts ciservice with the given configuration,
+ * emits ring events at a configurable rate and answers caller queries after a
+ * configurable delay. The services of the configuration run ci-bench-probe,
+ * which reports back when it was started, so the ring-to-spawn latency of every
+ * call can be measured.
+ */
+#include <glib.h>
+#include <glib-unix.h>
+#include <gio/gio.h>
+#include <gio/gunixsocketaddress.h>
+#include <cinetmsgs.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+struct {
+    gint port;
+    gdouble rate;
+    gint burst;
+    gint duration;
+    gint query_delay;
+    gint stage_delay;
+    gint drain;
+    gchar *config;
+    gchar *daemon;
+} ci_bench_options = { 63691, 10.0, 1, 10, 0, 0, 5, "bench/benchrc", "./ciservice" };
+
+struct {
+    GMainLoop *mainloop;
+    GSocketService *service;
+    GSocketConnection *connection;
+    GByteArray *inbuf;
+    guint8 readbuf[4096];
+    GSocket *probe_socket;
+    gchar *probe_path;
+    GPid daemon_pid;
+    gchar *bindir;
+
+    guint64 next_seq;
+    GHashTable *ring_times; /* seq -> gint64 * */
+    GArray *latencies;      /* gint64, microseconds */
+    guint64 queries;
+    guint64 probes;
+    gint64 first_ring;
+    gint64 last_probe;
+    guint ring_source;
+} ci_bench;
+
+void ci_bench_send(CINetMsg *msg)
+{
+    gchar *buffer = NULL;
+    gsize len = 0;
+
+    if (ci_bench.connection == NULL)
+        return;
+
+    if (cinet_msg_write_msg(&buffer, &len, msg) == 0 && buffer != NULL) {
+        g_output_stream_write_all(g_io_stream_get_output_stream(G_IO_STREAM(ci_bench.connection)),
+                buffer, len, NULL, NULL, NULL);
+    }
+    g_free(buffer);
+}
+
+void ci_bench_send_ring(guint64 seq, CINetMsgMultipartStage stage)
+{
+    CINetMsg *msg = cinet_message_new(CI_NET_MSG_EVENT_RING, NULL, NULL);
+    if (msg == NULL)
+        return;
+
+    CICallInfo *callinfo = &((CINetMsgEventRing *)msg)->callinfo;
+    ((CINetMsgMultipart *)msg)->stage = stage;
+
+    gchar *number = g_strdup_printf("%010" G_GUINT64_FORMAT, seq);
+    GDateTime *now = g_date_time_new_now_local();
+
+    callinfo->completenumber = g_strconcat("030", number, NULL);
+    callinfo->number = number;
+    callinfo->areacode = g_strdup("030");
+    callinfo->area = g_strdup("Berlin");
+    callinfo->name = g_strdup("");
+    callinfo->date = g_date_time_format(now, "%Y-%m-%d");
+    callinfo->time = g_date_time_format(now, "%H:%M:%S");
+    callinfo->msn = g_strdup("12345");
+    callinfo->alias = g_strdup("bench");
+    g_date_time_unref(now);
+
+    ci_bench_send(msg);
+    cinet_msg_free(msg);
+}
+
+gboolean ci_bench_quit_cb(GMainLoop *mainloop)
+{
+    g_main_loop_quit(mainloop);
+    return FALSE;
+}
+
+gboolean ci_bench_complete_ring_cb(gpointer seq)
+{
+    ci_bench_send_ring(GPOINTER_TO_SIZE(seq), MultipartStageComplete);
+    return FALSE;
+}
+
+gboolean ci_bench_ring_cb(gpointer userdata)
+{
+    gint i;
+    gint64 now = g_get_monotonic_time();
+    gint64 *ring_time;
+
+    if (ci_bench.first_ring == 0)
+        ci_bench.first_ring = now;
+
+    if (now - ci_bench.first_ring >= (gint64)ci_bench_options.duration * G_USEC_PER_SEC) {
+        ci_bench.ring_source = 0;
+        g_timeout_add_seconds(ci_bench_options.drain, (GSourceFunc)ci_bench_quit_cb, ci_bench.mainloop);
+        return FALSE;
+    }
+
+    for (i = 0; i < ci_bench_options.burst; ++i) {
+        guint64 seq = ci_bench.next_seq++;
+
+        ring_time = g_new(gint64, 1);
+        *ring_time = g_get_monotonic_time();
+        g_hash_table_insert(ci_bench.ring_times, g_memdup(&seq, sizeof(guint64)), ring_time);
+
+        /* the number is already known in the first stage */
+        ci_bench_send_ring(seq, MultipartStageInit);
+        if (ci_bench_options.stage_delay > 0)
+            g_timeout_add(ci_bench_options.stage_delay, ci_bench_complete_ring_cb, GSIZE_TO_POINTER(seq));
+        else
+            ci_bench_send_ring(seq, MultipartStageComplete);
+    }
+
+    return TRUE;
+}
+
+gboolean ci_bench_query_reply_cb(CINetMsg *msg)
+{
+    CINetMsgDbGetCaller *query = (CINetMsgDbGetCaller *)msg;
+
+    /* answer with the request itself so the reply carries its guid */
+    g_free(query->caller.name);
+    query->caller.name = g_strdup("Bench Caller");
+    ci_bench_send(msg);
+    cinet_msg_free(msg);
+
+    return FALSE;
+}
+
+void ci_bench_handle_message(CINetMsg *msg)
+{
+    switch (msg->msgtype) {
+        case CI_NET_MSG_DB_GET_CALLER:
+            ++ci_bench.queries;
+            if (ci_bench_options.query_delay > 0)
+                g_timeout_add(ci_bench_options.query_delay, (GSourceFunc)ci_bench_query_reply_cb, msg);
+            else
+                ci_bench_query_reply_cb(msg);
+            return;
+        case CI_NET_MSG_VERSION:
+            ci_bench_send(msg);
+            break;
+        default:
+            break;
+    }
+    cinet_msg_free(msg);
+}
+
+void ci_bench_read_cb(GInputStream *stream, GAsyncResult *result, gpointer userdata)
+{
+    gssize len = g_input_stream_read_finish(stream, result, NULL);
+    CINetMsgHeader header;
+    CINetMsg *msg;
+    gsize total;
+
+    if (len <= 0) {
+        fprintf(stderr, "ciservice closed the connection.\n");
+        g_clear_object(&ci_bench.connection);
+        return;
+    }
+
+    g_byte_array_append(ci_bench.inbuf, ci_bench.readbuf, len);
+
+    while (ci_bench.inbuf->len >= CINetMsgHeaderSize) {
+        if (cinet_msg_read_header(&header, (gchar *)ci_bench.inbuf->data, ci_bench.inbuf->len) != 0)
+            break;
+        total = CINetMsgHeaderSize + header.msglen;
+        if (ci_bench.inbuf->len < total)
+            break;
+        msg = NULL;
+        if (cinet_msg_read_msg(&msg, (gchar *)ci_bench.inbuf->data, total) == 0 && msg != NULL)
+            ci_bench_handle_message(msg);
+        g_byte_array_remove_range(ci_bench.inbuf, 0, total);
+    }
+
+    g_input_stream_read_async(stream, ci_bench.readbuf, sizeof(ci_bench.readbuf),
+            G_PRIORITY_DEFAULT, NULL, (GAsyncReadyCallback)ci_bench_read_cb, NULL);
+}
+
+gboolean ci_bench_incoming_cb(GSocketService *service, GSocketConnection *connection,
+                              GObject *source, gpointer userdata)
+{
+    if (ci_bench.connection != NULL)
+        return FALSE;
+
+    ci_bench.connection = g_object_ref(connection);
+    g_input_stream_read_async(g_io_stream_get_input_stream(G_IO_STREAM(connection)),
+            ci_bench.readbuf, sizeof(ci_bench.readbuf),
+            G_PRIORITY_DEFAULT, NULL, (GAsyncReadyCallback)ci_bench_read_cb, NULL);
+
+    if (ci_bench.ring_source == 0) {
+        guint interval = (guint)(1000.0 * ci_bench_options.burst / ci_bench_options.rate);
+        ci_bench.ring_source = g_timeout_add(MAX(interval, 1), ci_bench_ring_cb, NULL);
+    }
+
+    return TRUE;
+}
+
+gboolean ci_bench_probe_cb(GSocket *socket, GIOCondition condition, gpointer userdata)
+{
+    gchar buffer[128];
+    gssize len;
+    guint64 seq;
+    gint64 spawned;
+    gint64 *ring_time;
+
+    while ((len = g_socket_receive(socket, buffer, sizeof(buffer) - 1, NULL, NULL)) > 0) {
+        buffer[len] = 0;
+        /* completenumber is "030" followed by the sequence number */
+        if (sscanf(buffer, "030%" G_GUINT64_FORMAT " %" G_GINT64_FORMAT, &seq, &spawned) != 2)
+            continue;
+        ring_time = g_hash_table_lookup(ci_bench.ring_times, &seq);
+        if (ring_time == NULL)
+            continue;
+        gint64 latency = spawned - *ring_time;
+        g_array_append_val(ci_bench.latencies, latency);
+        ++ci_bench.probes;
+        ci_bench.last_probe = spawned;
+    }
+
+    return TRUE;
+}
+
+gint ci_bench_compare_latency(gconstpointer a, gconstpointer b)
+{
+    gint64 x = *(const gint64 *)a;
+    gint64 y = *(const gint64 *)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+gint64 ci_bench_percentile(gdouble p)
+{
+    guint index = (guint)(p * (ci_bench.latencies->len - 1) + 0.5);
+    return g_array_index(ci_bench.latencies, gint64, index);
+}
+
+void ci_bench_report(void)
+{
+    guint64 rings = ci_bench.next_seq;
+
+    fprintf(stdout, "rings sent:      %" G_GUINT64_FORMAT "\n", rings);
+    fprintf(stdout, "caller queries:  %" G_GUINT64_FORMAT "\n", ci_bench.queries);
+    fprintf(stdout, "spawns seen:     %" G_GUINT64_FORMAT "\n", ci_bench.probes);
+
+    if (ci_bench.latencies->len == 0)
+        return;
+
+    g_array_sort(ci_bench.latencies, ci_bench_compare_latency);
+    fprintf(stdout, "ring-to-spawn latency (us): p50=%" G_GINT64_FORMAT " p90=%" G_GINT64_FORMAT
+            " p99=%" G_GINT64_FORMAT " max=%" G_GINT64_FORMAT "\n",
+            ci_bench_percentile(0.5), ci_bench_percentile(0.9), ci_bench_percentile(0.99),
+            g_array_index(ci_bench.latencies, gint64, ci_bench.latencies->len - 1));
+
+    if (ci_bench.last_probe > ci_bench.first_ring)
+        fprintf(stdout, "sustained:       %.1f spawns/s\n",
+                ci_bench.probes * (gdouble)G_USEC_PER_SEC / (ci_bench.last_probe - ci_bench.first_ring));
+}
+
+gboolean ci_bench_start_daemon(void)
+{
+    gchar *port = g_strdup_printf("%d", ci_bench_options.port);
+    gchar *argv[] = { ci_bench_options.daemon, "-f", ci_bench_options.config,
+                      "-h", "127.0.0.1", "-p", port, NULL };
+    gchar **envp = g_environ_setenv(g_get_environ(), "CI_BENCH_SOCKET", ci_bench.probe_path, TRUE);
+    GError *error = NULL;
+    gboolean result;
+
+    /* make ci-bench-probe available to the services */
+    gchar *absbindir = g_canonicalize_filename(ci_bench.bindir, NULL);
+    gchar *path = g_strconcat(absbindir, ":", g_environ_getenv(envp, "PATH"), NULL);
+    envp = g_environ_setenv(envp, "PATH", path, TRUE);
+
+    result = g_spawn_async(NULL, argv, envp, G_SPAWN_DO_NOT_REAP_CHILD,
+            NULL, NULL, &ci_bench.daemon_pid, &error);
+    if (!result) {
+        fprintf(stderr, "Could not start `%s': %s\n", ci_bench_options.daemon, error->message);
+        g_error_free(error);
+    }
+
+    g_free(path);
+    g_free(absbindir);
+    g_strfreev(envp);
+    g_free(port);
+
+    return result;
+}
+
+gboolean ci_bench_setup(void)
+{
+    GError *error = NULL;
+
+    ci_bench.service = g_socket_service_new();
+    if (!g_socket_listener_add_inet_port(G_SOCKET_LISTENER(ci_bench.service),
+                ci_bench_options.port, NULL, &error)) {
+        fprintf(stderr, "Could not listen on port %d: %s\n", ci_bench_options.port, error->message);
+        g_error_free(error);
+        return FALSE;
+    }
+    g_signal_connect(ci_bench.service, "incoming", G_CALLBACK(ci_bench_incoming_cb), NULL);
+
+    ci_bench.probe_path = g_strdup_printf("%s/ci-bench-%d.sock", g_get_tmp_dir(), getpid());
+    ci_bench.probe_socket = g_socket_new(G_SOCKET_FAMILY_UNIX, G_SOCKET_TYPE_DATAGRAM,
+            G_SOCKET_PROTOCOL_DEFAULT, &error);
+    if (ci_bench.probe_socket == NULL) {
+        fprintf(stderr, "Could not create probe socket: %s\n", error->message);
+        g_error_free(error);
+        return FALSE;
+    }
+    GSocketAddress *address = g_unix_socket_address_new(ci_bench.probe_path);
+    if (!g_socket_bind(ci_bench.probe_socket, address, TRUE, &error)) {
+        fprintf(stderr, "Could not bind probe socket: %s\n", error->message);
+        g_error_free(error);
+        g_object_unref(address);
+        return FALSE;
+    }
+    g_object_unref(address);
+    g_socket_set_blocking(ci_bench.probe_socket, FALSE);
+
+    GSource *source = g_socket_create_source(ci_bench.probe_socket, G_IO_IN, NULL);
+    g_source_set_callback(source, (GSourceFunc)ci_bench_probe_cb, NULL, NULL);
+    g_source_attach(source, NULL);
+    g_source_unref(source);
+
+    return TRUE;
+}
+
+int main(int argc, char **argv)
+{
+    GOptionEntry options[] = {
+        { "port", 'p', 0, G_OPTION_ARG_INT, &ci_bench_options.port,
+            "Port to listen on.", NULL },
+        { "rate", 'r', 0, G_OPTION_ARG_DOUBLE, &ci_bench_options.rate,
+            "Rings per second.", NULL },
+        { "burst", 'b', 0, G_OPTION_ARG_INT, &ci_bench_options.burst,
+            "Rings sent back-to-back per tick.", NULL },
+        { "duration", 't', 0, G_OPTION_ARG_INT, &ci_bench_options.duration,
+            "Seconds to send rings.", NULL },
+        { "query-delay", 'q', 0, G_OPTION_ARG_INT, &ci_bench_options.query_delay,
+            "Milliseconds before answering a caller query.", NULL },
+        { "stage-delay", 's', 0, G_OPTION_ARG_INT, &ci_bench_options.stage_delay,
+            "Milliseconds between the first and the complete stage of a ring.", NULL },
+        { "drain", 0, 0, G_OPTION_ARG_INT, &ci_bench_options.drain,
+            "Seconds to wait for outstanding spawns.", NULL },
+        { "config", 'f', 0, G_OPTION_ARG_FILENAME, &ci_bench_options.config,
+            "ciservicerc to benchmark.", NULL },
+        { "daemon", 'd', 0, G_OPTION_ARG_FILENAME, &ci_bench_options.daemon,
+            "ciservice binary.", NULL },
+        { NULL }
+    };
+    GError *error = NULL;
+
+    ci_bench.bindir = g_path_get_dirname(argv[0]);
+
+    GOptionContext *context = g_option_context_new("- load test for ciservice");
+    g_option_context_add_main_entries(context, options, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        fprintf(stderr, "%s\n", error->message);
+        g_error_free(error);
+        return 1;
+    }
+    g_option_context_free(context);
+
+    if (ci_bench_options.rate <= 0 || ci_bench_options.burst <= 0) {
+        fprintf(stderr, "rate and burst must be positive.\n");
+        return 1;
+    }
+
+    ci_bench.ring_times = g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free, g_free);
+    ci_bench.latencies = g_array_new(FALSE, FALSE, sizeof(gint64));
+    ci_bench.inbuf = g_byte_array_new();
+    ci_bench.mainloop = g_main_loop_new(NULL, FALSE);
+
+    if (!ci_bench_setup() || !ci_bench_start_daemon())
+        return 1;
+
+    g_unix_signal_add(SIGINT, (GSourceFunc)ci_bench_quit_cb, ci_bench.mainloop);
+    g_main_loop_run(ci_bench.mainloop);
+
+    kill(ci_bench.daemon_pid, SIGTERM);
+    waitpid(ci_bench.daemon_pid, NULL, 0);
+
+    ci_bench_report();
+
+    unlink(ci_bench.probe_path);
+    g_free(ci_bench.bindir);
+    g_free(ci_bench.probe_path);
+    g_object_unref(ci_bench.probe_socket);
+    g_clear_object(&ci_bench.connection);
+    g_object_unref(ci_bench.service);
+    g_hash_table_destroy(ci_bench.ring_times);
+    g_array_free(ci_bench.latencies, TRUE);
+    g_byte_array_free(ci_bench.inbuf, TRUE);
+    g_main_loop_unref(ci_bench.mainloop);
+
+    return 0;
+}
@@ -0,0 +1,246 @@
+/* Microbenchmark for ci_service_run_commands.
+ *
+ * Links ci-service.c directly; the spawner is replaced by a stub that only
+ * records the job and reports it as exited after the call, so the numbers
+ * cover expansion and dispatch without fork/exec. The threaded cases expand
+ * on the dispatch pool and wait on the main loop until every service has
+ * spawned.
+ *
+ * Allocations are counted by overriding malloc and friends on top of glibc's
+ * __libc_malloc, __libc_calloc, __libc_realloc and __libc_free, so this only
+ * builds against glibc.
+ *
+ * usage: ci-bench-service [iterations]
+ */
+#include <glib.h>
+#include <cinetmsgs.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../ci-service.h"
+#include "../ci-spawner.h"
+#include "../ci-stats.h"
+
+/* count heap allocations; GLib allocates through malloc, also from the dispatch threads */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static guint64 ci_bench_allocations = 0;
+
+void *malloc(size_t size)
+{
+    __sync_fetch_and_add(&ci_bench_allocations, 1);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    __sync_fetch_and_add(&ci_bench_allocations, 1);
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    __sync_fetch_and_add(&ci_bench_allocations, 1);
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+    __libc_free(ptr);
+}
+
+/* spawner stub: jobs are finished in ci_bench_finish_jobs, like the real
+ * spawner does from the main loop */
+#define CI_BENCH_MAX_JOBS 1024
+
+struct {
+    CISpawnerExitCallback exit_cb;
+    gpointer userdata;
+} ci_bench_jobs[CI_BENCH_MAX_JOBS];
+guint ci_bench_n_jobs = 0;
+guint ci_bench_next_job = 1;
+
+gboolean ci_spawner_start(void)
+{
+    return TRUE;
+}
+
+void ci_spawner_stop(void)
+{
+}
+
+gboolean ci_spawner_is_running(void)
+{
+    return TRUE;
+}
+
+guint ci_spawner_spawn(const gchar *file, gchar **argv, gchar **env, const gchar *input, gsize input_length,
+                       CISpawnerStartCallback start_cb, CISpawnerExitCallback exit_cb,
+                       gpointer userdata)
+{
+    if (ci_bench_n_jobs >= CI_BENCH_MAX_JOBS)
+        return 0;
+
+    ci_bench_jobs[ci_bench_n_jobs].exit_cb = exit_cb;
+    ci_bench_jobs[ci_bench_n_jobs].userdata = userdata;
+    ++ci_bench_n_jobs;
+
+    if (start_cb)
+        start_cb(1, userdata);
+
+    return ci_bench_next_job++;
+}
+
+void ci_spawner_kill(guint job, gint signum)
+{
+}
+
+void ci_bench_finish_jobs(void)
+{
+    guint i;
+
+    /* exit callbacks may start queued jobs */
+    for (i = 0; i < ci_bench_n_jobs; ++i)
+        ci_bench_jobs[i].exit_cb(0, ci_bench_jobs[i].userdata);
+    ci_bench_n_jobs = 0;
+}
+
+/* answers every caller query immediately, as a cache hit would */
+void ci_bench_query_caller_cb(const gchar *completenumber, gint userid, gpointer userdata,
+                              CIServiceQueryCompleteCallback complete_cb, gpointer servicedata)
+{
+    complete_cb((const gchar *)userdata, servicedata);
+}
+
+struct CIBenchCase {
+    const gchar *description;
+    const gchar *commandline;
+};
+
+struct CIBenchCase ci_bench_templates[] = {
+    { "no placeholder", "true --notify" },
+    { "1 placeholder", "true ${number}" },
+    { "8 placeholders", "true ${number} ${areacode} ${area} --name=${name} ${time} ${msn} ${alias} ${completenumber}" },
+    { NULL, NULL }
+};
+
+void ci_bench_fill_callinfo(CICallInfo *callinfo, gsize length)
+{
+    gchar *padding = g_strnfill(length, 'x');
+
+    callinfo->number = g_strdup("1234567");
+    callinfo->areacode = g_strdup("030");
+    callinfo->area = g_strconcat("Berlin", padding, NULL);
+    callinfo->name = g_strconcat("Caller", padding, NULL);
+    callinfo->date = g_strdup("2024-01-01");
+    callinfo->time = g_strdup("12:00:00");
+    callinfo->msn = g_strdup("12345");
+    callinfo->alias = g_strconcat("Office", padding, NULL);
+    callinfo->completenumber = g_strdup("0301234567");
+
+    g_free(padding);
+}
+
+void ci_bench_free_callinfo(CICallInfo *callinfo)
+{
+    g_free(callinfo->number);
+    g_free(callinfo->areacode);
+    g_free(callinfo->area);
+    g_free(callinfo->name);
+    g_free(callinfo->date);
+    g_free(callinfo->time);
+    g_free(callinfo->msn);
+    g_free(callinfo->alias);
+    g_free(callinfo->completenumber);
+}
+
+/* with dispatch threads the jobs are spawned from the main loop once expanded */
+void ci_bench_run_commands(CICallInfo *callinfo, guint n_services, guint threads)
+{
+    ci_service_run_commands("default", callinfo, ci_bench_query_caller_cb, "Resolved Caller");
+    while (threads > 0 && ci_bench_n_jobs < n_services)
+        g_main_context_iteration(NULL, TRUE);
+    ci_bench_finish_jobs();
+}
+
+void ci_bench_run(guint n_services, struct CIBenchCase *template, gsize length,
+                  gboolean query, guint threads, guint iterations)
+{
+    CICallInfo callinfo;
+    CIService *service;
+    gchar *identifier;
+    guint i;
+    gint64 start, end;
+    guint64 allocations;
+
+    for (i = 0; i < n_services; ++i) {
+        identifier = g_strdup_printf("bench%u", i);
+        service = ci_service_add_service(identifier, template->commandline, TRUE);
+        g_free(identifier);
+        if (service == NULL) {
+            fprintf(stderr, "Could not add service `%s'.\n", template->commandline);
+            ci_service_cleanup();
+            return;
+        }
+        if (query)
+            ci_service_set_userid(service, 0);
+    }
+
+    ci_service_set_dispatch_threads(threads);
+
+    memset(&callinfo, 0, sizeof(CICallInfo));
+    ci_bench_fill_callinfo(&callinfo, length);
+
+    /* warm up */
+    for (i = 0; i < 16; ++i)
+        ci_bench_run_commands(&callinfo, n_services, threads);
+
+    allocations = ci_bench_allocations;
+    start = g_get_monotonic_time();
+    for (i = 0; i < iterations; ++i)
+        ci_bench_run_commands(&callinfo, n_services, threads);
+    end = g_get_monotonic_time();
+    allocations = ci_bench_allocations - allocations;
+
+    fprintf(stdout, "%3u services  %-15s  %4" G_GSIZE_FORMAT " byte fields  %-8s  %u threads  %10.1f ns/call  %8.1f allocs/call\n",
+            n_services, template->description, length, query ? "query" : "no query", threads,
+            (end - start) * 1000.0 / iterations,
+            (gdouble)allocations / iterations);
+
+    ci_bench_free_callinfo(&callinfo);
+    ci_service_set_dispatch_threads(0);
+    ci_service_cleanup();
+}
+
+int main(int argc, char **argv)
+{
+    guint services[] = { 1, 10, 100 };
+    gsize lengths[] = { 0, 256 };
+    guint iterations = 10000;
+    guint s, t, l;
+
+    if (argc > 1)
+        iterations = (guint)strtoul(argv[1], NULL, 10);
+    if (iterations == 0)
+        iterations = 1;
+
+    for (s = 0; s < G_N_ELEMENTS(services); ++s) {
+        for (t = 0; ci_bench_templates[t].commandline != NULL; ++t) {
+            for (l = 0; l < G_N_ELEMENTS(lengths); ++l) {
+                /* keep the total work per case roughly constant */
+                ci_bench_run(services[s], &ci_bench_templates[t], lengths[l], FALSE, 0,
+                        MAX(iterations / services[s], 10));
+            }
+        }
+        ci_bench_run(services[s], &ci_bench_templates[2], 0, TRUE, 0, MAX(iterations / services[s], 10));
+        /* expansion on the dispatch pool, as with dispatch-threads */
+        ci_bench_run(services[s], &ci_bench_templates[2], 256, FALSE, 4, MAX(iterations / services[s], 10));
+    }
+
+    ci_stats_cleanup();
+
+    return 0;
+}
@@ -0,0 +1,124 @@
+#include "ci-caller-cache.h"
+
+struct CICallerCacheEntry {
+    gchar *key;
+    gchar *name;
+    gint64 expires;
+    GList link;
+};
+
+struct {
+    GHashTable *entries;
+    GQueue lru;    /* most recently used at head */
+    guint size;
+    gint ttl;
+    gint negative_ttl;
+} ci_caller_cache = { NULL, G_QUEUE_INIT, 256, 300, 60 };
+
+void ci_caller_cache_entry_free(struct CICallerCacheEntry *entry)
+{
+    if (entry == NULL)
+        return;
+    g_free(entry->key);
+    g_free(entry->name);
+    g_free(entry);
+}
+
+gchar *ci_caller_cache_make_key(const gchar *server, gint userid, const gchar *number)
+{
+    return g_strdup_printf("%s:%d:%s", server ? server : "", userid, number ? number : "");
+}
+
+void ci_caller_cache_remove(struct CICallerCacheEntry *entry)
+{
+    g_queue_unlink(&ci_caller_cache.lru, &entry->link);
+    /* frees the entry */
+    g_hash_table_remove(ci_caller_cache.entries, entry->key);
+}
+
+void ci_caller_cache_set_limits(guint size, gint ttl, gint negative_ttl)
+{
+    ci_caller_cache.size = size;
+    ci_caller_cache.ttl = ttl;
+    ci_caller_cache.negative_ttl = negative_ttl;
+
+    while (ci_caller_cache.lru.length > size)
+        ci_caller_cache_remove((struct CICallerCacheEntry *)ci_caller_cache.lru.tail->data);
+}
+
+gboolean ci_caller_cache_lookup(const gchar *server, gint userid, const gchar *number, gchar **name)
+{
+    if (ci_caller_cache.entries == NULL || number == NULL)
+        return FALSE;
+
+    gchar *key = ci_caller_cache_make_key(server, userid, number);
+    struct CICallerCacheEntry *entry = g_hash_table_lookup(ci_caller_cache.entries, key);
+    g_free(key);
+
+    if (entry == NULL)
+        return FALSE;
+
+    if (entry->expires <= g_get_monotonic_time()) {
+        ci_caller_cache_remove(entry);
+        return FALSE;
+    }
+
+    g_queue_unlink(&ci_caller_cache.lru, &entry->link);
+    g_queue_push_head_link(&ci_caller_cache.lru, &entry->link);
+
+    if (name)
+        *name = g_strdup(entry->name);
+
+    return TRUE;
+}
+
+void ci_caller_cache_insert(const gchar *server, gint userid, const gchar *number, const gchar *name)
+{
+    if (ci_caller_cache.size == 0 || number == NULL)
+        return;
+
+    gboolean negative = (name == NULL || name[0] == 0);
+    gint ttl = negative ? ci_caller_cache.negative_ttl : ci_caller_cache.ttl;
+    if (ttl <= 0)
+        return;
+
+    if (ci_caller_cache.entries == NULL)
+        ci_caller_cache.entries = g_hash_table_new_full(g_str_hash, g_str_equal,
+                NULL, (GDestroyNotify)ci_caller_cache_entry_free);
+
+    gchar *key = ci_caller_cache_make_key(server, userid, number);
+    struct CICallerCacheEntry *entry = g_hash_table_lookup(ci_caller_cache.entries, key);
+
+    if (entry != NULL) {
+        g_free(key);
+        g_free(entry->name);
+        g_queue_unlink(&ci_caller_cache.lru, &entry->link);
+    }
+    else {
+        if (ci_caller_cache.lru.length >= ci_caller_cache.size)
+            ci_caller_cache_remove((struct CICallerCacheEntry *)ci_caller_cache.lru.tail->data);
+        entry = g_malloc0(sizeof(struct CICallerCacheEntry));
+        entry->key = key;
+        entry->link.data = entry;
+        g_hash_table_insert(ci_caller_cache.entries, entry->key, entry);
+    }
+
+    entry->name = negative ? NULL : g_strdup(name);
+    entry->expires = g_get_monotonic_time() + (gint64)ttl * G_USEC_PER_SEC;
+    g_queue_push_head_link(&ci_caller_cache.lru, &entry->link);
+}
+
+void ci_caller_cache_clear(void)
+{
+    g_queue_init(&ci_caller_cache.lru);
+    if (ci_caller_cache.entries != NULL)
+        g_hash_table_remove_all(ci_caller_cache.entries);
+}
+
+void ci_caller_cache_cleanup(void)
+{
+    g_queue_init(&ci_caller_cache.lru);
+    if (ci_caller_cache.entries != NULL)
+        g_hash_table_destroy(ci_caller_cache.entries);
+    ci_caller_cache.entries = NULL;
+}
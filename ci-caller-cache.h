@@ -0,0 +1,17 @@
+#ifndef __CI_CALLER_CACHE_H__
+#define __CI_CALLER_CACHE_H__
+
+#include <glib.h>
+
+/* size: maximum number of entries (0 disables the cache), ttl in seconds */
+void ci_caller_cache_set_limits(guint size, gint ttl, gint negative_ttl);
+
+/* returns TRUE on a hit; name is set to a copy of the cached name or to NULL for unknown callers */
+gboolean ci_caller_cache_lookup(const gchar *server, gint userid, const gchar *number, gchar **name);
+/* name == NULL or "" stores a negative entry */
+void ci_caller_cache_insert(const gchar *server, gint userid, const gchar *number, const gchar *name);
+
+void ci_caller_cache_clear(void);
+void ci_caller_cache_cleanup(void);
+
+#endif
@@ -7,14 +7,38 @@ struct {
     guint16 port;
     gint retry_interval;
     gchar *pidfile;
+    gchar *statsfile;
+    gchar *control_socket;
     gchar *config_file;
+    gchar **services;  /* activated on the command line */
+    GPtrArray *commands; /* given with --command */
+    gchar *control_command;
+
+    gint cache_size;
+    gint cache_ttl;
+    gint cache_negative_ttl;
+
+    gint dedup_window;
+    gint dedup_size;
+
+    gint dispatch_threads;
+
+    gchar *spool;
+    gint spool_segment_size;
+    gint spool_sync_interval;
+
+    GList *servers; /* [element-type: CIConfigServer *] */
+    gboolean servers_loaded;
+    gboolean default_server;
 
     gboolean print_version;
+    gboolean print_stats;
     gboolean list_services;
     gboolean daemonize;
 } ci_config;
 
 void ci_config_set_defaults(gboolean overwrite);
+void ci_config_setup_servers(void);
 
 gboolean ci_config_option_add_command(const gchar *option_name,
                                       const gchar *value,
@@ -27,6 +51,11 @@ gboolean ci_config_option_add_command(const gchar *option_name,
         return FALSE;
     }
 
+    /* kept to hand them to a running daemon */
+    if (ci_config.commands == NULL)
+        ci_config.commands = g_ptr_array_new_with_free_func(g_free);
+    g_ptr_array_add(ci_config.commands, g_strdup(value));
+
     return TRUE;
 }
 
@@ -64,6 +93,157 @@ gchar *ci_config_get_config_file(void)
     return NULL;
 }
 
+/* returns FALSE if the key is missing or not an integer; val is left untouched */
+gboolean ci_config_get_integer(GKeyFile *keyfile, const gchar *group, const gchar *key, gint *val)
+{
+    GError *err = NULL;
+    gint result = g_key_file_get_integer(keyfile, group, key, &err);
+
+    if (err) {
+        g_error_free(err);
+        return FALSE;
+    }
+
+    *val = result;
+    return TRUE;
+}
+
+/* returns FALSE if the key is missing or not a number; val is left untouched */
+gboolean ci_config_get_double(GKeyFile *keyfile, const gchar *group, const gchar *key, gdouble *val)
+{
+    GError *err = NULL;
+    gdouble result = g_key_file_get_double(keyfile, group, key, &err);
+
+    if (err) {
+        g_error_free(err);
+        return FALSE;
+    }
+
+    *val = result;
+    return TRUE;
+}
+
+/* all keys of a group as NULL-terminated key, value list */
+gchar **ci_config_get_group_options(GKeyFile *keyfile, const gchar *group)
+{
+    gsize len = 0;
+    gchar **keys = g_key_file_get_keys(keyfile, group, &len, NULL);
+    gchar **options = g_malloc0(sizeof(gchar *) * (2 * len + 1));
+    gsize i;
+
+    for (i = 0; i < len; ++i) {
+        options[2 * i] = g_strdup(keys[i]);
+        options[2 * i + 1] = g_key_file_get_string(keyfile, group, keys[i], NULL);
+        if (options[2 * i + 1] == NULL)
+            options[2 * i + 1] = g_strdup("");
+    }
+
+    g_strfreev(keys);
+    return options;
+}
+
+/* all keys and values of a group in one string, to detect changed services on reload */
+gchar *ci_config_get_group_signature(GKeyFile *keyfile, const gchar *group)
+{
+    gchar **options = ci_config_get_group_options(keyfile, group);
+    GString *signature = g_string_new(NULL);
+    guint i;
+
+    for (i = 0; options[i] != NULL && options[i + 1] != NULL; i += 2)
+        g_string_append_printf(signature, "%s=%s\n", options[i], options[i + 1]);
+
+    g_strfreev(options);
+    return g_string_free(signature, FALSE);
+}
+
+/* msn = 123;456 runs the service only for these values, exclude-msn = 789 never for this one */
+void ci_config_load_filters(GKeyFile *keyfile, const gchar *group, CIService *service)
+{
+    /* servers = a;b binds the service to these servers */
+    const gchar *keys[] = { "msn", "areacode", "alias", "number-prefix", "servers", NULL };
+    gchar **values;
+    gchar *key;
+    CIFilterField field;
+    guint i, j;
+
+    for (i = 0; keys[i] != NULL; ++i) {
+        if (g_strcmp0(keys[i], "servers") == 0)
+            field = CIFilterFieldServer;
+        else if (!ci_filter_field_from_string(keys[i], &field))
+            continue;
+        if ((values = g_key_file_get_string_list(keyfile, group, keys[i], NULL, NULL)) != NULL) {
+            for (j = 0; values[j] != NULL; ++j)
+                ci_service_add_filter(service, field, g_strstrip(values[j]), FALSE);
+            g_strfreev(values);
+        }
+        key = g_strconcat("exclude-", keys[i], NULL);
+        if ((values = g_key_file_get_string_list(keyfile, group, key, NULL, NULL)) != NULL) {
+            for (j = 0; values[j] != NULL; ++j)
+                ci_service_add_filter(service, field, g_strstrip(values[j]), TRUE);
+            g_strfreev(values);
+        }
+        g_free(key);
+    }
+}
+
+void ci_config_server_free(CIConfigServer *server)
+{
+    if (server == NULL)
+        return;
+    g_free(server->name);
+    g_free(server->host);
+    g_free(server);
+}
+
+/* [Server:<name>] groups; like the other server settings they are only read once.
+ * returns FALSE if there are more than CI_CONFIG_MAX_SERVERS servers, the extra ones are ignored */
+gboolean ci_config_load_servers(GKeyFile *keyfile)
+{
+    gchar **groups = g_key_file_get_groups(keyfile, NULL);
+    CIConfigServer *server;
+    gint value;
+    guint i;
+    guint n_servers;
+    gboolean result = TRUE;
+
+    if (ci_config.servers_loaded || groups == NULL) {
+        g_strfreev(groups);
+        return TRUE;
+    }
+    ci_config.servers_loaded = TRUE;
+
+    if (g_key_file_has_group(keyfile, "Server"))
+        ci_config.default_server = TRUE;
+    n_servers = ci_config.default_server ? 1 : 0;
+
+    for (i = 0; groups[i] != NULL; ++i) {
+        if (!g_str_has_prefix(groups[i], "Server:") || groups[i][7] == 0)
+            continue;
+        if (n_servers == CI_CONFIG_MAX_SERVERS) {
+            fprintf(stderr, "Too many servers, at most %d are supported; ignoring [%s].\n",
+                    CI_CONFIG_MAX_SERVERS, groups[i]);
+            result = FALSE;
+            continue;
+        }
+        ++n_servers;
+        server = g_malloc0(sizeof(CIConfigServer));
+        server->name = g_strdup(groups[i] + 7);
+        server->host = g_key_file_get_string(keyfile, groups[i], "host", NULL);
+        if (server->host == NULL)
+            server->host = g_strdup("localhost");
+        server->port = 63690;
+        if (ci_config_get_integer(keyfile, groups[i], "port", &value))
+            server->port = value;
+        server->retry_interval = -1;
+        ci_config_get_integer(keyfile, groups[i], "retry-interval", &server->retry_interval);
+        ci_config.servers = g_list_append(ci_config.servers, server);
+    }
+
+    g_strfreev(groups);
+    return result;
+}
+
+/* returns FALSE if the file could not be read or a service is invalid; valid services are added anyway */
 gboolean ci_config_load_file(void)
 {
     gchar *cfgfile = ci_config_get_config_file();
@@ -79,6 +259,22 @@ gboolean ci_config_load_file(void)
     /* check if these are already set via command line; if not read them from file */
     if (ci_config.pidfile == NULL)
         ci_config.pidfile = g_key_file_get_string(keyfile, "General", "pidfile", NULL);
+    if (ci_config.statsfile == NULL)
+        ci_config.statsfile = g_key_file_get_string(keyfile, "General", "statsfile", NULL);
+    if (ci_config.control_socket == NULL)
+        ci_config.control_socket = g_key_file_get_string(keyfile, "General", "controlsocket", NULL);
+    if (ci_config.dedup_window < 0 && g_key_file_has_key(keyfile, "General", "dedup-window", NULL))
+        ci_config.dedup_window = g_key_file_get_integer(keyfile, "General", "dedup-window", NULL);
+    if (ci_config.dedup_size < 0 && g_key_file_has_key(keyfile, "General", "dedup-size", NULL))
+        ci_config.dedup_size = g_key_file_get_integer(keyfile, "General", "dedup-size", NULL);
+    if (ci_config.dispatch_threads < 0 && g_key_file_has_key(keyfile, "General", "dispatch-threads", NULL))
+        ci_config.dispatch_threads = g_key_file_get_integer(keyfile, "General", "dispatch-threads", NULL);
+    if (ci_config.spool == NULL)
+        ci_config.spool = g_key_file_get_string(keyfile, "General", "spool", NULL);
+    if (ci_config.spool_segment_size < 0 && g_key_file_has_key(keyfile, "General", "spool-segment-size", NULL))
+        ci_config.spool_segment_size = g_key_file_get_integer(keyfile, "General", "spool-segment-size", NULL);
+    if (ci_config.spool_sync_interval < 0 && g_key_file_has_key(keyfile, "General", "spool-sync-interval", NULL))
+        ci_config.spool_sync_interval = g_key_file_get_integer(keyfile, "General", "spool-sync-interval", NULL);
     if (ci_config.hostname == NULL)
         ci_config.hostname = g_key_file_get_string(keyfile, "Server", "host", NULL);
     if (ci_config.port == 0)
@@ -86,6 +282,15 @@ gboolean ci_config_load_file(void)
     if (ci_config.retry_interval < 0 && g_key_file_has_key(keyfile, "Server", "retry-interval", NULL))
         ci_config.retry_interval = g_key_file_get_integer(keyfile, "Server", "retry-interval", NULL);
 
+    if (ci_config.cache_size < 0 && g_key_file_has_key(keyfile, "Cache", "size", NULL))
+        ci_config.cache_size = g_key_file_get_integer(keyfile, "Cache", "size", NULL);
+    if (ci_config.cache_ttl < 0 && g_key_file_has_key(keyfile, "Cache", "ttl", NULL))
+        ci_config.cache_ttl = g_key_file_get_integer(keyfile, "Cache", "ttl", NULL);
+    if (ci_config.cache_negative_ttl < 0 && g_key_file_has_key(keyfile, "Cache", "negative-ttl", NULL))
+        ci_config.cache_negative_ttl = g_key_file_get_integer(keyfile, "Cache", "negative-ttl", NULL);
+
+    gboolean result = ci_config_load_servers(keyfile);
+
     /* get services */
     gchar **services = g_key_file_get_groups(keyfile, NULL);
 
@@ -93,19 +298,68 @@ gboolean ci_config_load_file(void)
     CIService *service;
     gchar *cmd;
     gint userid;
+    gint value;
+    CIServiceOverflowPolicy policy;
+    CIServiceInputMode input;
+    CIServiceRateLimitPolicy rate_limit;
+    gdouble rate;
+    gint burst, summary_interval;
+    gchar **options;
+    gchar *format;
+    gint flush_interval, flush_size, rotate_size, rotate_count;
+    gint batch_window, batch_max;
+    gchar *signature;
     GError *err;
 
     if (services != NULL) {
         for (i = 0; services[i] != NULL; ++i) {
             if (g_strcmp0(services[i], "General") != 0 &&
-                g_strcmp0(services[i], "Server") != 0) {
-                cmd = g_key_file_get_string(keyfile, services[i], "commandline", NULL);
-                if (cmd == NULL)
+                g_strcmp0(services[i], "Server") != 0 &&
+                g_strcmp0(services[i], "Cache") != 0 &&
+                !g_str_has_prefix(services[i], "Server:")) {
+                signature = ci_config_get_group_signature(keyfile, services[i]);
+                if (ci_service_keep(services[i], signature)) {
+                    g_free(signature);
+                    continue;
+                }
+                if ((cmd = g_key_file_get_string(keyfile, services[i], "commandline", NULL)) != NULL) {
+                    service = ci_service_add_service(services[i], cmd, FALSE);
+                }
+                else if ((cmd = g_key_file_get_string(keyfile, services[i], "plugin", NULL)) != NULL) {
+                    options = ci_config_get_group_options(keyfile, services[i]);
+                    service = ci_service_add_plugin(services[i], cmd, (const gchar * const *)options, FALSE);
+                    g_strfreev(options);
+                }
+                else if ((cmd = g_key_file_get_string(keyfile, services[i], "logfile", NULL)) != NULL) {
+                    format = g_key_file_get_string(keyfile, services[i], "format", NULL);
+                    service = ci_service_add_logfile(services[i], cmd, format, FALSE);
+                    g_free(format);
+                    if (service != NULL) {
+                        flush_interval = 5;
+                        flush_size = 4096;
+                        rotate_size = 0;
+                        rotate_count = 3;
+                        ci_config_get_integer(keyfile, services[i], "flush-interval", &flush_interval);
+                        ci_config_get_integer(keyfile, services[i], "flush-size", &flush_size);
+                        ci_config_get_integer(keyfile, services[i], "rotate-size", &rotate_size);
+                        ci_config_get_integer(keyfile, services[i], "rotate-count", &rotate_count);
+                        ci_service_set_logfile_flush(service, MAX(flush_interval, 0), MAX(flush_size, 0));
+                        ci_service_set_logfile_rotation(service, MAX(rotate_size, 0), MAX(rotate_count, 0));
+                    }
+                }
+                else {
+                    g_free(signature);
                     continue;
-                service = ci_service_add_service(services[i], cmd, FALSE);
+                }
                 g_free(cmd);
-                if (service == NULL)
+                if (service == NULL) {
+                    fprintf(stderr, "Service `%s' is invalid.\n", services[i]);
+                    g_free(signature);
+                    result = FALSE;
                     continue;
+                }
+                ci_service_set_signature(service, signature);
+                g_free(signature);
                 err = NULL;
                 userid = g_key_file_get_integer(keyfile, services[i], "userid", &err);
                 if (!err) {
@@ -114,6 +368,58 @@ gboolean ci_config_load_file(void)
                 else {
                     g_error_free(err);
                 }
+                ci_config_load_filters(keyfile, services[i], service);
+                if (ci_config_get_integer(keyfile, services[i], "max-concurrent", &value))
+                    ci_service_set_max_concurrent(service, value);
+                if (ci_config_get_integer(keyfile, services[i], "queue-depth", &value))
+                    ci_service_set_queue_depth(service, value);
+                if (ci_config_get_integer(keyfile, services[i], "timeout", &value))
+                    ci_service_set_timeout(service, value);
+                if (ci_config_get_integer(keyfile, services[i], "query-timeout", &value))
+                    ci_service_set_query_timeout(service, value);
+                cmd = g_key_file_get_string(keyfile, services[i], "input", NULL);
+                if (cmd != NULL) {
+                    if (ci_service_input_mode_from_string(cmd, &input))
+                        ci_service_set_input_mode(service, input);
+                    else {
+                        fprintf(stderr, "Service `%s': unknown input mode `%s'.\n", services[i], cmd);
+                        result = FALSE;
+                    }
+                    g_free(cmd);
+                }
+                batch_window = 0;
+                batch_max = 0;
+                ci_config_get_integer(keyfile, services[i], "batch-window", &batch_window);
+                ci_config_get_integer(keyfile, services[i], "batch-max", &batch_max);
+                if (batch_window > 0 || batch_max > 1)
+                    ci_service_set_batch(service, batch_window, batch_max);
+                cmd = g_key_file_get_string(keyfile, services[i], "overflow", NULL);
+                if (cmd != NULL) {
+                    if (ci_service_overflow_policy_from_string(cmd, &policy))
+                        ci_service_set_overflow_policy(service, policy);
+                    else {
+                        fprintf(stderr, "Service `%s': unknown overflow policy `%s'.\n", services[i], cmd);
+                        result = FALSE;
+                    }
+                    g_free(cmd);
+                }
+                rate = 0;
+                if (ci_config_get_double(keyfile, services[i], "rate", &rate) && rate > 0) {
+                    burst = 1;
+                    summary_interval = 0;
+                    rate_limit = CIServiceRateLimitDrop;
+                    ci_config_get_integer(keyfile, services[i], "burst", &burst);
+                    ci_config_get_integer(keyfile, services[i], "summary-interval", &summary_interval);
+                    cmd = g_key_file_get_string(keyfile, services[i], "rate-limit", NULL);
+                    if (cmd != NULL) {
+                        if (!ci_service_rate_limit_policy_from_string(cmd, &rate_limit)) {
+                            fprintf(stderr, "Service `%s': unknown rate limit policy `%s'.\n", services[i], cmd);
+                            result = FALSE;
+                        }
+                        g_free(cmd);
+                    }
+                    ci_service_set_rate_limit(service, rate, burst, rate_limit, summary_interval);
+                }
             }
         }
 
@@ -123,17 +429,41 @@ gboolean ci_config_load_file(void)
     g_key_file_free(keyfile);
     g_free(cfgfile);
 
+    return result;
+}
+
+gboolean ci_config_reload(void)
+{
+    ci_service_begin_reload();
+
+    if (!ci_config_load_file()) {
+        fprintf(stderr, "Could not reload configuration, keeping the running services.\n");
+        ci_service_abort_reload();
+        return FALSE;
+    }
+
+    ci_service_commit_reload((const gchar * const *)ci_config.services);
     return TRUE;
 }
 
 gboolean ci_config_load(int *argc, char ***argv)
 {
     ci_config.retry_interval = -1;
+    ci_config.cache_size = -1;
+    ci_config.cache_ttl = -1;
+    ci_config.cache_negative_ttl = -1;
+    ci_config.dedup_window = -1;
+    ci_config.dedup_size = -1;
+    ci_config.dispatch_threads = -1;
+    ci_config.spool_segment_size = -1;
+    ci_config.spool_sync_interval = -1;
     GOptionEntry cmdline_options[] = {
         { "version", 'v', 0, G_OPTION_ARG_NONE, &ci_config.print_version,
             "Print version and exit.", NULL },
         { "list", 'l', 0, G_OPTION_ARG_NONE, &ci_config.list_services,
             "List available services and exit.", NULL },
+        { "stats", 's', 0, G_OPTION_ARG_NONE, &ci_config.print_stats,
+            "Print statistics of the running daemon and exit.", NULL },
         { "daemonize", 'd', 0, G_OPTION_ARG_NONE, &ci_config.daemonize,
             "Start in background.", NULL },
         { "host", 'h', 0, G_OPTION_ARG_STRING, &ci_config.hostname,
@@ -146,6 +476,8 @@ gboolean ci_config_load(int *argc, char ***argv)
             "Command to execute.", NULL },
         { "file", 'f', 0, G_OPTION_ARG_STRING, &ci_config.config_file,
             "Alternative configuration file.", NULL },
+        { "control", 'C', 0, G_OPTION_ARG_STRING, &ci_config.control_command,
+            "Send a command to the running daemon and exit.", NULL },
         { NULL }
     };
 
@@ -160,12 +492,17 @@ gboolean ci_config_load(int *argc, char ***argv)
         return FALSE;
     }
 
+    /* a server given on the command line is used besides named servers */
+    ci_config.default_server = ci_config.hostname != NULL || ci_config.port != 0;
+
     /* read config file */
     ci_config_load_file();
     /* add services from argv[1], argv[2], … if available in conf file */
     gint i;
     CIService *service;
+    ci_config.services = g_malloc0(sizeof(gchar *) * *argc);
     for (i = 1; i < *argc; ++i) {
+        ci_config.services[i - 1] = g_strdup((*argv)[i]);
         service = ci_service_get((*argv)[i]);
         if (service == NULL)
             fprintf(stderr, "Service `%s' not found.\n", (*argv)[i]);
@@ -174,9 +511,32 @@ gboolean ci_config_load(int *argc, char ***argv)
     }
 
     ci_config_set_defaults(FALSE);
+    ci_config_setup_servers();
     return TRUE;
 }
 
+/* add the default server and fill in missing server settings */
+void ci_config_setup_servers(void)
+{
+    GList *tmp;
+    CIConfigServer *server;
+
+    for (tmp = ci_config.servers; tmp != NULL; tmp = g_list_next(tmp)) {
+        server = (CIConfigServer *)tmp->data;
+        if (server->retry_interval < 0)
+            server->retry_interval = ci_config.retry_interval;
+    }
+
+    if (ci_config.servers == NULL || ci_config.default_server) {
+        server = g_malloc0(sizeof(CIConfigServer));
+        server->name = g_strdup("default");
+        server->host = g_strdup(ci_config.hostname);
+        server->port = ci_config.port;
+        server->retry_interval = ci_config.retry_interval;
+        ci_config.servers = g_list_prepend(ci_config.servers, server);
+    }
+}
+
 void ci_config_set_defaults(gboolean overwrite)
 {
     if (ci_config.retry_interval < 0 || overwrite)
@@ -189,13 +549,65 @@ void ci_config_set_defaults(gboolean overwrite)
 
     if (ci_config.port == 0 || overwrite)
         ci_config.port = 63690;
+
+    if ((ci_config.statsfile == NULL || overwrite) && ci_config.pidfile != NULL) {
+        g_free(ci_config.statsfile);
+        ci_config.statsfile = g_strconcat(ci_config.pidfile, ".stats", NULL);
+    }
+
+    if ((ci_config.control_socket == NULL || overwrite) && ci_config.pidfile != NULL) {
+        g_free(ci_config.control_socket);
+        ci_config.control_socket = g_strconcat(ci_config.pidfile, ".sock", NULL);
+    }
+
+    if (ci_config.cache_size < 0 || overwrite)
+        ci_config.cache_size = 256;
+    if (ci_config.cache_ttl < 0 || overwrite)
+        ci_config.cache_ttl = 300;
+    if (ci_config.cache_negative_ttl < 0 || overwrite)
+        ci_config.cache_negative_ttl = 60;
+    if (ci_config.dedup_window < 0 || overwrite)
+        ci_config.dedup_window = 0;
+    if (ci_config.dedup_size < 0 || overwrite)
+        ci_config.dedup_size = 1024;
+    if (ci_config.dispatch_threads < 0 || overwrite)
+        ci_config.dispatch_threads = 2;
+    if (ci_config.spool_segment_size < 0 || overwrite)
+        ci_config.spool_segment_size = 262144;
+    if (ci_config.spool_sync_interval < 0 || overwrite)
+        ci_config.spool_sync_interval = 1000;
 }
 
 void ci_config_cleanup(void)
 {
     g_free(ci_config.hostname);
     g_free(ci_config.pidfile);
+    g_free(ci_config.statsfile);
+    g_free(ci_config.control_socket);
+    g_free(ci_config.control_command);
+    g_free(ci_config.spool);
     g_free(ci_config.config_file);
+    g_strfreev(ci_config.services);
+    g_list_free_full(ci_config.servers, (GDestroyNotify)ci_config_server_free);
+    if (ci_config.commands != NULL)
+        g_ptr_array_free(ci_config.commands, TRUE);
+}
+
+GList *ci_config_get_servers(void)
+{
+    return ci_config.servers;
+}
+
+gchar **ci_config_get_commands(void)
+{
+    guint len = ci_config.commands ? ci_config.commands->len : 0;
+    gchar **commands = g_malloc0(sizeof(gchar *) * (len + 1));
+    guint i;
+
+    for (i = 0; i < len; ++i)
+        commands[i] = g_strdup(g_ptr_array_index(ci_config.commands, i));
+
+    return commands;
 }
 
 gboolean ci_config_get(const gchar *key, gpointer val)
@@ -213,10 +625,40 @@ gboolean ci_config_get(const gchar *key, gpointer val)
         *((gboolean *)val) = ci_config.print_version;
     else if (g_strcmp0(key, "list-services") == 0)
         *((gboolean *)val) = ci_config.list_services;
+    else if (g_strcmp0(key, "print-stats") == 0)
+        *((gboolean *)val) = ci_config.print_stats;
     else if (g_strcmp0(key, "pidfile") == 0)
         *((gchar **)val) = g_strdup(ci_config.pidfile);
+    else if (g_strcmp0(key, "statsfile") == 0)
+        *((gchar **)val) = g_strdup(ci_config.statsfile);
+    else if (g_strcmp0(key, "controlsocket") == 0)
+        *((gchar **)val) = g_strdup(ci_config.control_socket);
+    else if (g_strcmp0(key, "control-command") == 0)
+        *((gchar **)val) = g_strdup(ci_config.control_command);
+    else if (g_strcmp0(key, "services") == 0)
+        *((gchar ***)val) = g_strdupv(ci_config.services);
+    else if (g_strcmp0(key, "commands") == 0)
+        *((gchar ***)val) = ci_config_get_commands();
     else if (g_strcmp0(key, "retry-interval") == 0)
         *((gint *)val) = ci_config.retry_interval;
+    else if (g_strcmp0(key, "cache-size") == 0)
+        *((gint *)val) = ci_config.cache_size;
+    else if (g_strcmp0(key, "cache-ttl") == 0)
+        *((gint *)val) = ci_config.cache_ttl;
+    else if (g_strcmp0(key, "cache-negative-ttl") == 0)
+        *((gint *)val) = ci_config.cache_negative_ttl;
+    else if (g_strcmp0(key, "dedup-window") == 0)
+        *((gint *)val) = ci_config.dedup_window;
+    else if (g_strcmp0(key, "dedup-size") == 0)
+        *((gint *)val) = ci_config.dedup_size;
+    else if (g_strcmp0(key, "dispatch-threads") == 0)
+        *((gint *)val) = ci_config.dispatch_threads;
+    else if (g_strcmp0(key, "spool") == 0)
+        *((gchar **)val) = g_strdup(ci_config.spool);
+    else if (g_strcmp0(key, "spool-segment-size") == 0)
+        *((gint *)val) = ci_config.spool_segment_size;
+    else if (g_strcmp0(key, "spool-sync-interval") == 0)
+        *((gint *)val) = ci_config.spool_sync_interval;
     else
         return FALSE;
 
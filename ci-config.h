@@ -5,7 +5,24 @@
 
 gboolean ci_config_load(int *argc, char ***argv);
 void ci_config_cleanup(void);
+/* reread the services from the configuration file; the running set is kept on errors */
+gboolean ci_config_reload(void);
 
 gboolean ci_config_get(const gchar *key, gpointer val);
 
+typedef struct {
+    gchar *name;
+    gchar *host;
+    guint port;
+    gint retry_interval;
+} CIConfigServer;
+
+/* servers connected to at once, [Server] included; further groups are ignored */
+#define CI_CONFIG_MAX_SERVERS 8
+
+/* the [Server] group (named "default") and all [Server:<name>] groups;
+ * [Server] is left out if there are named servers and it is not configured
+ * [element-type: CIConfigServer *][transfer-none] */
+GList *ci_config_get_servers(void);
+
 #endif
@@ -0,0 +1,295 @@
+#include "ci-control.h"
+#include "ci-config.h"
+#include "ci-service.h"
+#include "ci-stats.h"
+#include <gio/gio.h>
+#include <gio/gunixsocketaddress.h>
+#include <stdio.h>
+#include <string.h>
+#include <glib/gstdio.h>
+
+/* seconds the client waits for the daemon */
+#define CI_CONTROL_CLIENT_TIMEOUT 10
+
+struct {
+    GSocketService *service;
+    gchar *path;
+    guint next_service; /* for identifiers of added services */
+} ci_control;
+
+struct CIControlConnection {
+    GSocketConnection *connection;
+    GDataInputStream *input;
+    /* reply being written; the next command is read once it is out */
+    GString *reply;
+    gsize written;
+    gboolean keep;
+};
+
+void ci_control_connection_free(struct CIControlConnection *conn)
+{
+    if (conn == NULL)
+        return;
+    g_io_stream_close(G_IO_STREAM(conn->connection), NULL, NULL);
+    g_object_unref(conn->input);
+    g_object_unref(conn->connection);
+    if (conn->reply)
+        g_string_free(conn->reply, TRUE);
+    g_free(conn);
+}
+
+CIService *ci_control_get_service(const gchar *identifier, GString *reply)
+{
+    CIService *service = identifier && identifier[0] ? ci_service_get(identifier) : NULL;
+
+    if (service == NULL)
+        g_string_append_printf(reply, "error: service `%s' not found\n", identifier ? identifier : "");
+
+    return service;
+}
+
+/* returns FALSE if the connection should be closed */
+gboolean ci_control_handle_command(gchar *line, GString *reply)
+{
+    gchar *command = g_strstrip(line);
+    gchar *args = strchr(command, ' ');
+    CIService *service;
+
+    if (args != NULL) {
+        *args = 0;
+        args = g_strchug(args + 1);
+    }
+
+    if (command[0] == 0)
+        return TRUE;
+
+    if (g_strcmp0(command, "add") == 0) {
+        if (args == NULL || args[0] == 0) {
+            g_string_append(reply, "error: missing command line\n");
+        }
+        else {
+            /* named so it can be deactivated and found in the list */
+            gchar *identifier = NULL;
+            do {
+                g_free(identifier);
+                identifier = g_strdup_printf("command-%u", ++ci_control.next_service);
+            } while (ci_service_get(identifier) != NULL);
+
+            if (!ci_service_add_service(identifier, args, TRUE))
+                g_string_append_printf(reply, "error: command `%s' is invalid\n", args);
+            else
+                g_string_append_printf(reply, "%s\nok\n", identifier);
+            g_free(identifier);
+        }
+    }
+    else if (g_strcmp0(command, "activate") == 0 || g_strcmp0(command, "deactivate") == 0) {
+        if ((service = ci_control_get_service(args, reply)) != NULL) {
+            ci_service_set_active(service, command[0] == 'a');
+            g_string_append(reply, "ok\n");
+        }
+    }
+    else if (g_strcmp0(command, "list") == 0) {
+        ci_service_dump_state(reply);
+        g_string_append(reply, "ok\n");
+    }
+    else if (g_strcmp0(command, "stats") == 0) {
+        ci_stats_dump(ci_stats_get_global(), "ciservice", reply);
+        ci_service_dump_stats(reply);
+        g_string_append(reply, "ok\n");
+    }
+    else if (g_strcmp0(command, "reload") == 0) {
+        if (ci_config_reload())
+            g_string_append(reply, "ok\n");
+        else
+            g_string_append(reply, "error: configuration not reloaded\n");
+    }
+    else if (g_strcmp0(command, "quit") == 0) {
+        return FALSE;
+    }
+    else {
+        g_string_append_printf(reply, "error: unknown command `%s'\n", command);
+    }
+
+    return TRUE;
+}
+
+void ci_control_read_cb(GDataInputStream *input, GAsyncResult *result, struct CIControlConnection *conn);
+
+/* continue with the next command once the reply is written */
+void ci_control_reply_done(struct CIControlConnection *conn)
+{
+    g_string_truncate(conn->reply, 0);
+    conn->written = 0;
+
+    if (!conn->keep) {
+        ci_control_connection_free(conn);
+        return;
+    }
+
+    g_data_input_stream_read_line_async(conn->input, G_PRIORITY_DEFAULT, NULL,
+            (GAsyncReadyCallback)ci_control_read_cb, conn);
+}
+
+/* a peer that does not read only holds its own connection, not the main loop */
+void ci_control_write_cb(GOutputStream *output, GAsyncResult *result, struct CIControlConnection *conn)
+{
+    gssize written = g_output_stream_write_finish(output, result, NULL);
+    if (written <= 0) {
+        ci_control_connection_free(conn);
+        return;
+    }
+
+    conn->written += written;
+    if (conn->written < conn->reply->len)
+        g_output_stream_write_async(output, conn->reply->str + conn->written,
+                conn->reply->len - conn->written, G_PRIORITY_DEFAULT, NULL,
+                (GAsyncReadyCallback)ci_control_write_cb, conn);
+    else
+        ci_control_reply_done(conn);
+}
+
+void ci_control_read_cb(GDataInputStream *input, GAsyncResult *result, struct CIControlConnection *conn)
+{
+    gchar *line = g_data_input_stream_read_line_finish(input, result, NULL, NULL);
+    if (line == NULL) {
+        ci_control_connection_free(conn);
+        return;
+    }
+
+    conn->keep = ci_control_handle_command(line, conn->reply);
+    g_free(line);
+
+    if (conn->reply->len == 0) {
+        ci_control_reply_done(conn);
+        return;
+    }
+
+    g_output_stream_write_async(g_io_stream_get_output_stream(G_IO_STREAM(conn->connection)),
+            conn->reply->str, conn->reply->len, G_PRIORITY_DEFAULT, NULL,
+            (GAsyncReadyCallback)ci_control_write_cb, conn);
+}
+
+gboolean ci_control_incoming_cb(GSocketService *service, GSocketConnection *connection,
+                                GObject *source, gpointer userdata)
+{
+    struct CIControlConnection *conn = g_malloc0(sizeof(struct CIControlConnection));
+    conn->connection = g_object_ref(connection);
+    conn->input = g_data_input_stream_new(g_io_stream_get_input_stream(G_IO_STREAM(connection)));
+    conn->reply = g_string_new(NULL);
+
+    g_data_input_stream_read_line_async(conn->input, G_PRIORITY_DEFAULT, NULL,
+            (GAsyncReadyCallback)ci_control_read_cb, conn);
+
+    return TRUE;
+}
+
+gboolean ci_control_start(const gchar *path)
+{
+    g_return_val_if_fail(ci_control.service == NULL, FALSE);
+
+    if (path == NULL || path[0] == 0)
+        return FALSE;
+
+    GError *error = NULL;
+    GSocketAddress *address;
+
+    /* a stale socket of a crashed daemon */
+    g_unlink(path);
+
+    ci_control.service = g_socket_service_new();
+    address = g_unix_socket_address_new(path);
+    if (!g_socket_listener_add_address(G_SOCKET_LISTENER(ci_control.service), address,
+                G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_DEFAULT, NULL, NULL, &error)) {
+        fprintf(stderr, "Could not create control socket `%s': %s\n", path, error->message);
+        g_error_free(error);
+        g_object_unref(address);
+        g_object_unref(ci_control.service);
+        ci_control.service = NULL;
+        return FALSE;
+    }
+    g_object_unref(address);
+    g_chmod(path, 0600);
+
+    g_signal_connect(ci_control.service, "incoming", G_CALLBACK(ci_control_incoming_cb), NULL);
+    g_socket_service_start(ci_control.service);
+    ci_control.path = g_strdup(path);
+
+    return TRUE;
+}
+
+void ci_control_stop(void)
+{
+    if (ci_control.service == NULL)
+        return;
+
+    g_socket_service_stop(ci_control.service);
+    g_socket_listener_close(G_SOCKET_LISTENER(ci_control.service));
+    g_object_unref(ci_control.service);
+    ci_control.service = NULL;
+
+    g_unlink(ci_control.path);
+    g_free(ci_control.path);
+    ci_control.path = NULL;
+}
+
+gboolean ci_control_send(const gchar *path, const gchar *command, GString *reply)
+{
+    if (path == NULL || command == NULL)
+        return FALSE;
+
+    GError *error = NULL;
+    GSocketClient *client = g_socket_client_new();
+    GSocketAddress *address = g_unix_socket_address_new(path);
+    /* a daemon that stopped reading must not hang the command line */
+    g_socket_client_set_timeout(client, CI_CONTROL_CLIENT_TIMEOUT);
+    GSocketConnection *connection;
+    GDataInputStream *input;
+    gchar *line;
+    gchar *request;
+    gboolean result = FALSE;
+
+    connection = g_socket_client_connect(client, G_SOCKET_CONNECTABLE(address), NULL, &error);
+    g_object_unref(address);
+    g_object_unref(client);
+    if (connection == NULL) {
+        fprintf(stderr, "Could not connect to `%s': %s\n", path, error->message);
+        g_error_free(error);
+        return FALSE;
+    }
+
+    request = g_strconcat(command, "\n", NULL);
+    if (!g_output_stream_write_all(g_io_stream_get_output_stream(G_IO_STREAM(connection)),
+                request, strlen(request), NULL, NULL, &error)) {
+        fprintf(stderr, "Could not send command: %s\n", error->message);
+        g_error_free(error);
+        g_free(request);
+        g_object_unref(connection);
+        return FALSE;
+    }
+    g_free(request);
+
+    input = g_data_input_stream_new(g_io_stream_get_input_stream(G_IO_STREAM(connection)));
+    while ((line = g_data_input_stream_read_line(input, NULL, NULL, NULL)) != NULL) {
+        if (g_strcmp0(line, "ok") == 0) {
+            result = TRUE;
+            g_free(line);
+            break;
+        }
+        if (g_str_has_prefix(line, "error: ")) {
+            fprintf(stderr, "%s\n", line + 7);
+            g_free(line);
+            break;
+        }
+        if (reply != NULL) {
+            g_string_append(reply, line);
+            g_string_append_c(reply, '\n');
+        }
+        g_free(line);
+    }
+
+    g_object_unref(input);
+    g_io_stream_close(G_IO_STREAM(connection), NULL, NULL);
+    g_object_unref(connection);
+
+    return result;
+}
@@ -0,0 +1,24 @@
+#ifndef __CI_CONTROL_H__
+#define __CI_CONTROL_H__
+
+#include <glib.h>
+
+/* line based control socket of the daemon; each command is answered with
+ * zero or more lines of output followed by "ok" or "error: <message>".
+ *   add <commandline>       add and activate a command line service, prints
+ *                           the identifier it was given (command-<n>)
+ *   activate <service>
+ *   deactivate <service>
+ *   list                    services with state and queue lengths
+ *   stats                   counters and latency histograms
+ *   reload                  reread the configuration file */
+
+/* listen on path; call from the daemon before the main loop runs */
+gboolean ci_control_start(const gchar *path);
+void ci_control_stop(void);
+
+/* send one command to the daemon listening on path and append its output
+ * (without the final status line) to reply; returns TRUE on "ok" */
+gboolean ci_control_send(const gchar *path, const gchar *command, GString *reply);
+
+#endif
@@ -0,0 +1,87 @@
+#include "ci-dedup.h"
+
+struct CIDedupEntry {
+    gchar *key;
+    gint64 expires;
+    GList link;
+};
+
+struct {
+    GHashTable *entries;
+    GQueue fifo;    /* oldest at head; all entries have the same lifetime */
+    gint window;
+    guint size;
+} ci_dedup = { NULL, G_QUEUE_INIT, 0, 1024 };
+
+void ci_dedup_entry_free(struct CIDedupEntry *entry)
+{
+    if (entry == NULL)
+        return;
+    g_free(entry->key);
+    g_free(entry);
+}
+
+void ci_dedup_remove(struct CIDedupEntry *entry)
+{
+    g_queue_unlink(&ci_dedup.fifo, &entry->link);
+    /* frees the entry */
+    g_hash_table_remove(ci_dedup.entries, entry->key);
+}
+
+void ci_dedup_set_window(gint window, guint size)
+{
+    ci_dedup.window = window;
+    ci_dedup.size = size;
+
+    while (ci_dedup.fifo.length > 0 && (window <= 0 || ci_dedup.fifo.length > size))
+        ci_dedup_remove((struct CIDedupEntry *)ci_dedup.fifo.head->data);
+}
+
+gboolean ci_dedup_check(const gchar *server, CICallInfo *callinfo)
+{
+    if (ci_dedup.window <= 0 || ci_dedup.size == 0 || callinfo == NULL)
+        return FALSE;
+
+    gint64 now = g_get_monotonic_time();
+    struct CIDedupEntry *entry;
+
+    if (ci_dedup.entries == NULL)
+        ci_dedup.entries = g_hash_table_new_full(g_str_hash, g_str_equal,
+                NULL, (GDestroyNotify)ci_dedup_entry_free);
+
+    while (ci_dedup.fifo.length > 0 &&
+            ((struct CIDedupEntry *)ci_dedup.fifo.head->data)->expires <= now)
+        ci_dedup_remove((struct CIDedupEntry *)ci_dedup.fifo.head->data);
+
+    gchar *key = g_strdup_printf("%s|%s|%s|%s %s",
+            server ? server : "",
+            callinfo->completenumber ? callinfo->completenumber : "",
+            callinfo->msn ? callinfo->msn : "",
+            callinfo->date ? callinfo->date : "",
+            callinfo->time ? callinfo->time : "");
+
+    if (g_hash_table_lookup(ci_dedup.entries, key) != NULL) {
+        g_free(key);
+        return TRUE;
+    }
+
+    if (ci_dedup.fifo.length >= ci_dedup.size)
+        ci_dedup_remove((struct CIDedupEntry *)ci_dedup.fifo.head->data);
+
+    entry = g_malloc0(sizeof(struct CIDedupEntry));
+    entry->key = key;
+    entry->expires = now + (gint64)ci_dedup.window * G_USEC_PER_SEC;
+    entry->link.data = entry;
+    g_hash_table_insert(ci_dedup.entries, entry->key, entry);
+    g_queue_push_tail_link(&ci_dedup.fifo, &entry->link);
+
+    return FALSE;
+}
+
+void ci_dedup_cleanup(void)
+{
+    g_queue_init(&ci_dedup.fifo);
+    if (ci_dedup.entries != NULL)
+        g_hash_table_destroy(ci_dedup.entries);
+    ci_dedup.entries = NULL;
+}
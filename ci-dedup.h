@@ -0,0 +1,16 @@
+#ifndef __CI_DEDUP_H__
+#define __CI_DEDUP_H__
+
+#include <glib.h>
+#include <cinetmsgs.h>
+
+/* window in seconds (0 disables), size: maximum number of remembered calls */
+void ci_dedup_set_window(gint window, guint size);
+
+/* returns TRUE if the same call (server, complete number, msn, date and time) was
+ * seen within the window; remembers the call otherwise */
+gboolean ci_dedup_check(const gchar *server, CICallInfo *callinfo);
+
+void ci_dedup_cleanup(void);
+
+#endif
@@ -0,0 +1,285 @@
+#include "ci-filter.h"
+#include <string.h>
+
+struct CIFilter {
+    GSList *include[CIFilterFieldCount]; /* [element-type: gchar *] */
+    GSList *exclude[CIFilterFieldCount];
+};
+
+/* digits, '+', '*' and '#' */
+#define CI_FILTER_TRIE_WIDTH 13
+
+struct CIFilterTrieNode {
+    guint64 *slots; /* services with a prefix ending here */
+    struct CIFilterTrieNode *children[CI_FILTER_TRIE_WIDTH];
+};
+
+/* values of one field; numbers are matched by prefix in a trie, the rest by hash */
+struct CIFilterTable {
+    GHashTable *values; /* value -> guint64 * */
+    struct CIFilterTrieNode *trie;
+};
+
+struct CIFilterIndex {
+    guint size;
+    guint words;
+    /* slots without included values for a field pass it */
+    guint64 *unrestricted[CIFilterFieldCount];
+    struct CIFilterTable include[CIFilterFieldCount];
+    struct CIFilterTable exclude[CIFilterFieldCount];
+    guint64 *result;
+    guint64 *scratch;
+};
+
+const gchar *ci_filter_field_names[CIFilterFieldCount] = {
+    "msn", "areacode", "alias", "number-prefix", "server"
+};
+
+CIFilter *ci_filter_new(void)
+{
+    return g_malloc0(sizeof(struct CIFilter));
+}
+
+void ci_filter_free(CIFilter *filter)
+{
+    if (filter == NULL)
+        return;
+
+    guint i;
+    for (i = 0; i < CIFilterFieldCount; ++i) {
+        g_slist_free_full(filter->include[i], g_free);
+        g_slist_free_full(filter->exclude[i], g_free);
+    }
+    g_free(filter);
+}
+
+void ci_filter_add(CIFilter *filter, CIFilterField field, const gchar *value, gboolean exclude)
+{
+    g_return_if_fail(filter != NULL && field < CIFilterFieldCount && value != NULL);
+
+    if (exclude)
+        filter->exclude[field] = g_slist_prepend(filter->exclude[field], g_strdup(value));
+    else
+        filter->include[field] = g_slist_prepend(filter->include[field], g_strdup(value));
+}
+
+gboolean ci_filter_field_from_string(const gchar *str, CIFilterField *field)
+{
+    guint i;
+
+    if (str == NULL || field == NULL)
+        return FALSE;
+
+    for (i = 0; i < CIFilterFieldCount; ++i) {
+        if (g_strcmp0(str, ci_filter_field_names[i]) == 0) {
+            *field = (CIFilterField)i;
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+gint ci_filter_trie_child(gchar c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c == '+')
+        return 10;
+    if (c == '*')
+        return 11;
+    if (c == '#')
+        return 12;
+    return -1;
+}
+
+void ci_filter_trie_free(struct CIFilterTrieNode *node)
+{
+    if (node == NULL)
+        return;
+
+    guint i;
+    for (i = 0; i < CI_FILTER_TRIE_WIDTH; ++i)
+        ci_filter_trie_free(node->children[i]);
+    g_free(node->slots);
+    g_free(node);
+}
+
+void ci_filter_set_slot(guint64 *bits, guint slot)
+{
+    bits[slot / 64] |= G_GUINT64_CONSTANT(1) << (slot % 64);
+}
+
+guint64 *ci_filter_table_get_slots(CIFilterIndex *index, struct CIFilterTable *table,
+                                   CIFilterField field, const gchar *value)
+{
+    guint64 *slots;
+
+    if (field == CIFilterFieldNumberPrefix) {
+        struct CIFilterTrieNode **node = &table->trie;
+        gint child;
+
+        if (*node == NULL)
+            *node = g_malloc0(sizeof(struct CIFilterTrieNode));
+        for (; *value; ++value) {
+            if ((child = ci_filter_trie_child(*value)) == -1)
+                continue;
+            node = &(*node)->children[child];
+            if (*node == NULL)
+                *node = g_malloc0(sizeof(struct CIFilterTrieNode));
+        }
+        if ((*node)->slots == NULL)
+            (*node)->slots = g_malloc0(sizeof(guint64) * index->words);
+        return (*node)->slots;
+    }
+
+    if (table->values == NULL)
+        table->values = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    if ((slots = g_hash_table_lookup(table->values, value)) == NULL) {
+        slots = g_malloc0(sizeof(guint64) * index->words);
+        g_hash_table_insert(table->values, g_strdup(value), slots);
+    }
+    return slots;
+}
+
+CIFilterIndex *ci_filter_index_new(guint size)
+{
+    CIFilterIndex *index = g_malloc0(sizeof(struct CIFilterIndex));
+    guint i;
+
+    index->size = size;
+    index->words = MAX((size + 63) / 64, 1);
+    for (i = 0; i < CIFilterFieldCount; ++i)
+        index->unrestricted[i] = g_malloc0(sizeof(guint64) * index->words);
+    index->result = g_malloc0(sizeof(guint64) * index->words);
+    index->scratch = g_malloc0(sizeof(guint64) * index->words);
+
+    return index;
+}
+
+void ci_filter_index_free(CIFilterIndex *index)
+{
+    if (index == NULL)
+        return;
+
+    guint i;
+    for (i = 0; i < CIFilterFieldCount; ++i) {
+        g_free(index->unrestricted[i]);
+        if (index->include[i].values)
+            g_hash_table_destroy(index->include[i].values);
+        if (index->exclude[i].values)
+            g_hash_table_destroy(index->exclude[i].values);
+        ci_filter_trie_free(index->include[i].trie);
+        ci_filter_trie_free(index->exclude[i].trie);
+    }
+    g_free(index->result);
+    g_free(index->scratch);
+    g_free(index);
+}
+
+void ci_filter_index_add(CIFilterIndex *index, guint slot, CIFilter *filter)
+{
+    g_return_if_fail(index != NULL && slot < index->size);
+
+    guint i;
+    GSList *tmp;
+
+    for (i = 0; i < CIFilterFieldCount; ++i) {
+        if (filter == NULL || filter->include[i] == NULL)
+            ci_filter_set_slot(index->unrestricted[i], slot);
+        if (filter == NULL)
+            continue;
+        for (tmp = filter->include[i]; tmp != NULL; tmp = g_slist_next(tmp))
+            ci_filter_set_slot(ci_filter_table_get_slots(index, &index->include[i], i, (gchar *)tmp->data), slot);
+        for (tmp = filter->exclude[i]; tmp != NULL; tmp = g_slist_next(tmp))
+            ci_filter_set_slot(ci_filter_table_get_slots(index, &index->exclude[i], i, (gchar *)tmp->data), slot);
+    }
+}
+
+/* or the slots of all entries matching value into bits */
+void ci_filter_table_lookup(CIFilterIndex *index, struct CIFilterTable *table,
+                            CIFilterField field, const gchar *value, guint64 *bits)
+{
+    const guint64 *slots = NULL;
+    guint i;
+
+    if (value == NULL)
+        value = "";
+
+    if (field != CIFilterFieldNumberPrefix) {
+        if (table->values != NULL && (slots = g_hash_table_lookup(table->values, value)) != NULL) {
+            for (i = 0; i < index->words; ++i)
+                bits[i] |= slots[i];
+        }
+        return;
+    }
+
+    /* every prefix of the number on the path through the trie */
+    struct CIFilterTrieNode *node = table->trie;
+    gint child;
+    while (node != NULL) {
+        if (node->slots != NULL) {
+            for (i = 0; i < index->words; ++i)
+                bits[i] |= node->slots[i];
+        }
+        while (*value && (child = ci_filter_trie_child(*value)) == -1)
+            ++value;
+        if (*value == 0)
+            break;
+        node = node->children[child];
+        ++value;
+    }
+}
+
+const gchar *ci_filter_get_value(const gchar *server, CICallInfo *callinfo, CIFilterField field)
+{
+    switch (field) {
+        case CIFilterFieldMsn:
+            return callinfo->msn;
+        case CIFilterFieldAreacode:
+            return callinfo->areacode;
+        case CIFilterFieldAlias:
+            return callinfo->alias;
+        case CIFilterFieldNumberPrefix:
+            return callinfo->completenumber && callinfo->completenumber[0] ?
+                callinfo->completenumber : callinfo->number;
+        case CIFilterFieldServer:
+            return server;
+        default:
+            return NULL;
+    }
+}
+
+const guint64 *ci_filter_index_match(CIFilterIndex *index, const gchar *server, CICallInfo *callinfo)
+{
+    g_return_val_if_fail(index != NULL && callinfo != NULL, NULL);
+
+    guint i, w;
+    const gchar *value;
+
+    memset(index->result, 0xff, sizeof(guint64) * index->words);
+    if (index->size % 64)
+        index->result[index->words - 1] = (G_GUINT64_CONSTANT(1) << (index->size % 64)) - 1;
+    else if (index->size == 0)
+        index->result[0] = 0;
+
+    for (i = 0; i < CIFilterFieldCount; ++i) {
+        value = ci_filter_get_value(server, callinfo, (CIFilterField)i);
+
+        if (index->include[i].values != NULL || index->include[i].trie != NULL) {
+            memcpy(index->scratch, index->unrestricted[i], sizeof(guint64) * index->words);
+            ci_filter_table_lookup(index, &index->include[i], i, value, index->scratch);
+            for (w = 0; w < index->words; ++w)
+                index->result[w] &= index->scratch[w];
+        }
+
+        if (index->exclude[i].values != NULL || index->exclude[i].trie != NULL) {
+            memset(index->scratch, 0, sizeof(guint64) * index->words);
+            ci_filter_table_lookup(index, &index->exclude[i], i, value, index->scratch);
+            for (w = 0; w < index->words; ++w)
+                index->result[w] &= ~index->scratch[w];
+        }
+    }
+
+    return index->result;
+}
@@ -0,0 +1,37 @@
+#ifndef __CI_FILTER_H__
+#define __CI_FILTER_H__
+
+#include <glib.h>
+#include <cinetmsgs.h>
+
+typedef enum {
+    CIFilterFieldMsn = 0,
+    CIFilterFieldAreacode,
+    CIFilterFieldAlias,
+    CIFilterFieldNumberPrefix, /* prefix of the complete number */
+    CIFilterFieldServer,       /* name of the server the call came from */
+    CIFilterFieldCount
+} CIFilterField;
+
+/* the filter of one service: per field a list of values to include and to exclude;
+ * a call passes if it matches one included value of every field that has some,
+ * and no excluded value */
+typedef struct CIFilter CIFilter;
+
+CIFilter *ci_filter_new(void);
+void ci_filter_free(CIFilter *filter);
+void ci_filter_add(CIFilter *filter, CIFilterField field, const gchar *value, gboolean exclude);
+gboolean ci_filter_field_from_string(const gchar *str, CIFilterField *field);
+
+/* filters of a list of services compiled for matching all of them at once */
+typedef struct CIFilterIndex CIFilterIndex;
+
+CIFilterIndex *ci_filter_index_new(guint size);
+void ci_filter_index_free(CIFilterIndex *index);
+/* slot < size; filter == NULL passes every call */
+void ci_filter_index_add(CIFilterIndex *index, guint slot, CIFilter *filter);
+
+/* returns the slots passing the call as bitset, owned by the index and valid until the next match */
+const guint64 *ci_filter_index_match(CIFilterIndex *index, const gchar *server, CICallInfo *callinfo);
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef __CI_PLUGIN_H__
+#define __CI_PLUGIN_H__
+
+#include <glib.h>
+#include <gmodule.h>
+
+/* Interface for in-process services loaded with `plugin = /path/libfoo.so`.
+ *
+ * A plugin exports the following symbols:
+ *   guint ci_plugin_get_abi_version(void);   must return CI_PLUGIN_ABI_VERSION
+ *   gboolean ci_plugin_init(const gchar *identifier, const gchar * const *options,
+ *                           gpointer *plugin_data);                        optional
+ *   void ci_plugin_handle_call(const CIPluginCall *call, gpointer plugin_data);
+ *   void ci_plugin_cleanup(gpointer plugin_data);                          optional
+ *
+ * options is a NULL-terminated list of key, value pairs from the service group.
+ * All functions are called from the main loop and must not block.
+ * New fields are only ever appended to CIPluginCall; check struct_size before
+ * using fields added in later versions.
+ */
+
+#define CI_PLUGIN_ABI_VERSION 1
+
+typedef struct {
+    gsize struct_size;
+    const gchar *service;
+    const gchar *completenumber;
+    const gchar *number;
+    const gchar *areacode;
+    const gchar *area;
+    const gchar *name;  /* resolved caller name if the service has a userid */
+    const gchar *date;
+    const gchar *time;
+    const gchar *msn;
+    const gchar *alias;
+} CIPluginCall;
+
+typedef guint (*CIPluginGetAbiVersionFunc)(void);
+typedef gboolean (*CIPluginInitFunc)(const gchar *, const gchar * const *, gpointer *);
+typedef void (*CIPluginHandleCallFunc)(const CIPluginCall *, gpointer);
+typedef void (*CIPluginCleanupFunc)(gpointer);
+
+#endif
@@ -1,242 +1,2397 @@
 #include "ci-service.h"
+#include "ci-spawner.h"
+#include "ci-plugin.h"
+#include "ci-stats.h"
+#include "ci-filter.h"
+#include "ci-spool.h"
+#include <gmodule.h>
+#include <gio/gio.h>
 #include <string.h>
 #include <stdio.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+/* fields of a call, in the order of ci_service_placeholders */
+typedef enum {
+    CIServiceFieldCompletenumber = 0,
+    CIServiceFieldNumber,
+    CIServiceFieldAreacode,
+    CIServiceFieldArea,
+    CIServiceFieldName,
+    CIServiceFieldDate,
+    CIServiceFieldTime,
+    CIServiceFieldMsn,
+    CIServiceFieldAlias,
+    /* only for placeholders, not in records or the environment */
+    CIServiceFieldDatetime, /* built from date and time on first use */
+    CIServiceFieldEpoch,
+    CIServiceFieldService, /* identifier of the service, not stored in the call */
+    CIServiceFieldSuppressed, /* calls folded into a rate limit summary */
+    CIServiceFieldCount
+} CIServiceField;
+
+#define CI_SERVICE_RECORD_FIELDS (CIServiceFieldAlias + 1)
+
+/* sets of fields */
+#define CI_SERVICE_FIELD_BIT(field) (1u << (field))
+#define CI_SERVICE_RECORD_MASK (CI_SERVICE_FIELD_BIT(CI_SERVICE_RECORD_FIELDS) - 1)
+
+/* one piece of an argument: either literal text or a placeholder for a field */
+struct CIServiceTemplateSegment {
+    gchar *literal;
+    CIServiceField field;
+};
+
+struct CIServiceTemplateArg {
+    guint n_segments;
+    struct CIServiceTemplateSegment *segments;
+};
+
+/* command line parsed once at load time; only the slots are filled per call */
+struct CIServiceTemplate {
+    gint argc;
+    struct CIServiceTemplateArg *args;
+    guint32 fields; /* used by the slots */
+};
+
+typedef enum {
+    CIServiceTypeCommand = 0,
+    CIServiceTypePlugin,
+    CIServiceTypeLogfile
+} CIServiceType;
+
+struct CIServicePlugin {
+    GModule *module;
+    CIPluginHandleCallFunc handle_call;
+    CIPluginCleanupFunc cleanup;
+    gpointer data;
+};
+
+/* formatted lines are collected in buffer and written in batches */
+struct CIServiceLogfile {
+    gchar *filename;
+    gint fd;
+    gsize size;
+    struct CIServiceTemplateArg format;
+    GString *buffer;
+    guint flush_interval;
+    gsize flush_size;
+    guint flush_source;
+    gsize rotate_size;
+    guint rotate_count;
+    CIStats *stats; /* of the service */
+};
 
 struct CIService {
     gchar *identifier;
-    gchar *command;
+    gchar *command;    /* command line, plugin or log file name */
+    gchar *signature;  /* configuration the service was created from */
+    gint refcount;     /* held by ci_services, jobs, queries and an open batch */
+    CIServiceType type;
+    struct CIServiceTemplate *template;
+    gchar *program;         /* first word of the command line */
+    gchar *path;            /* program resolved in PATH, NULL while it is missing */
+    GFileMonitor *monitor;  /* on path, or on the last path while missing */
+    struct CIServicePlugin *plugin;
+    struct CIServiceLogfile *logfile;
     gint userid;
     gboolean active;
+
+    CIFilter *filter;
+    guint slot; /* position in ci_services_index */
+
+    CIServiceInputMode input;
+
+    /* execution limits */
+    gint max_concurrent;
+    gint queue_depth;
+    gint timeout;
+    gint query_timeout; /* milliseconds */
+    CIServiceOverflowPolicy overflow;
+
+    GQueue running; /* [element-type: struct CIServiceJob *] */
+    GQueue pending; /* [element-type: struct CIServiceJob *] */
+
+    CIStats *stats;
+
+    /* calls collected for one invocation; argv is expanded from the first call */
+    gint batch_window;
+    gint batch_max;
+    GPtrArray *batch_values; /* [element-type: struct CIServiceCall *] */
+    gint batch_count;
+    guint batch_source;
+    gint64 batch_ring_time;
+    GSList *batch_spool; /* [element-type: CISpoolEntry *] */
+
+    /* expanded works are run in the order they were submitted */
+    guint64 work_submitted;
+    guint64 work_finished;
+    GQueue work_ready; /* [element-type: struct CIServiceWork *] expanded early, by seq */
+
+    /* token bucket: rate tokens per minute up to burst, one per call; rate <= 0: unlimited */
+    gdouble rate;
+    gint burst;
+    gdouble tokens;
+    gint64 refill_time;
+    CIServiceRateLimitPolicy rate_limit;
+    gint summary_interval;
+    guint suppressed; /* calls since the last summary */
+    struct CIServiceCall *suppressed_call; /* the last of them */
+    guint summary_source;
+};
+
+struct CIServiceJob {
+    struct CIService *service;
+    gchar **argv; /* one block, see ci_service_template_expand */
+    gchar **env;  /* one block, see ci_service_build_env */
+    GString *input;
+    guint spawner_job;
+    guint timeout_source;
+    gboolean terminated;
+    GSList *spool; /* [element-type: CISpoolEntry *] calls of the job, done when it ends */
+
+    /* g_get_monotonic_time() at the pipeline stages */
+    gint64 ring_time;
+    gint64 queue_time;
+    gint64 start_time;
+    gint64 spawn_time;
+};
+
+/* command lines, environment and input of a job, expanded by a dispatch thread;
+ * created and finished on the main loop, the thread only reads the call values and
+ * the service's template, input mode and identifier, which do not change once it runs */
+struct CIServiceWork {
+    struct CIService *service;
+    struct CIServiceCall *call; /* single call */
+    GPtrArray *batch;    /* [element-type: struct CIServiceCall *] calls of a batch, or NULL */
+    GSList *spool;
+    gint64 ring_time;
+    gint64 dispatch_time;
+    guint64 seq; /* of the service's works */
+
+    gchar **argv;
+    gchar **env;
+    GString *input;
+};
+
+/* values of one call, shared by the services it is dispatched to; the strings are
+ * copied into the arena behind the struct, so a call is a single allocation */
+struct CIServiceCall {
+    gint refcount;              /* atomic */
+    struct CIServiceCall *base; /* call whose fields are used, with the name replaced */
+    gsize size;                 /* of arena */
+    const gchar *fields[CIServiceFieldCount];
+    gchar *derived[2];          /* ${datetime} and ${epoch} once used, see ci_service_call_derived */
+    gchar arena[];
+};
+
+/* bytes of arena of the calls kept in ci_service_call_slab, larger calls are not recycled */
+#define CI_SERVICE_CALL_ARENA 512
+
+/* free lists for the objects allocated per call; only used from the main loop */
+struct CIServiceSlab {
+    gsize size;
+    guint max_free;
+    guint n_free;
+    gpointer free; /* the first word of each free object points to the next one */
 };
 
+struct CIServiceSlab ci_service_call_slab = { sizeof(struct CIServiceCall) + CI_SERVICE_CALL_ARENA, 64, 0, NULL };
+struct CIServiceSlab ci_service_work_slab = { sizeof(struct CIServiceWork), 64, 0, NULL };
+struct CIServiceSlab ci_service_job_slab = { sizeof(struct CIServiceJob), 64, 0, NULL };
+
 GList *ci_services = NULL;
-GRegex *ci_service_regex = NULL;
 
-void ci_service_run(const gchar *command);
-gboolean ci_service_regex_eval_cb(const GMatchInfo *info, GString *res, gpointer data);
+/* while reloading, new services are collected in ci_services and the running ones kept here */
+GList *ci_services_previous = NULL;
+gboolean ci_services_reloading = FALSE;
+/* removed or replaced services still finishing jobs or queries; not referenced by this list */
+GList *ci_services_retired = NULL;
+
+/* filters of ci_services, rebuilt when services or filters change */
+CIFilterIndex *ci_services_index = NULL;
+GPtrArray *ci_services_slots = NULL; /* [element-type: struct CIService *] */
+/* fields the active services use, only these are copied into a call; updated with the index */
+guint32 ci_services_fields = 0;
+
+/* expands commands off the main loop; NULL: expand on the main loop */
+GThreadPool *ci_services_dispatch = NULL;
+/* works expanded by the threads, picked up by an idle source on the main loop */
+GAsyncQueue *ci_services_expanded = NULL;
+
+/* withdraws timed out queries, see ci_service_set_query_cancel */
+CIServiceQueryCancelCallback ci_services_query_cancel = NULL;
+
+/* file monitors start GLib's worker thread, so they are only created after the forks */
+gboolean ci_services_monitoring = FALSE;
+
+/* seconds between SIGTERM and SIGKILL for jobs exceeding their timeout */
+#define CI_SERVICE_KILL_GRACE 5
+
+/* milliseconds to wait for the caller's name before running without it */
+#define CI_SERVICE_QUERY_TIMEOUT 5000
+
+/* seconds an open batch is kept if only batch-max is set */
+#define CI_SERVICE_BATCH_WINDOW 10
+
+/* seconds between summaries of calls over the rate of a service */
+#define CI_SERVICE_SUMMARY_INTERVAL 60
+
+/* unwritten log lines kept for the next attempt */
+#define CI_SERVICE_LOGFILE_MAX_BUFFER (1024 * 1024)
+
+#define CI_SERVICE_LOGFILE_DEFAULT_FORMAT \
+    "${time} (${areacode}) ${number} (${area}) ${name} an ${msn} (${alias})"
+
+/* indexed by CIServiceField */
+const gchar *ci_service_placeholders[] = {
+    "${completenumber}", "${number}", "${areacode}", "${area}", "${name}",
+    "${date}", "${time}", "${msn}", "${alias}",
+    "${datetime}", "${epoch}", "${service}", "${suppressed}", NULL
+};
+
+struct CIServiceRecordField {
+    const gchar *key;
+    const gchar *env;
+};
+
+/* the first CI_SERVICE_RECORD_FIELDS fields */
+struct CIServiceRecordField ci_service_record_fields[CI_SERVICE_RECORD_FIELDS] = {
+    { "completenumber", "CI_COMPLETENUMBER" },
+    { "number", "CI_NUMBER" },
+    { "areacode", "CI_AREACODE" },
+    { "area", "CI_AREA" },
+    { "name", "CI_NAME" },
+    { "date", "CI_DATE" },
+    { "time", "CI_TIME" },
+    { "msn", "CI_MSN" },
+    { "alias", "CI_ALIAS" }
+};
+
+void ci_service_run(struct CIService *service, gchar **argv, gchar **env, GString *input, gint64 ring_time,
+                    GSList *spool);
+struct CIService *ci_service_new(const gchar *identifier, const gchar *command, gboolean active);
+struct CIService *ci_service_ref(struct CIService *service);
+void ci_service_unref(struct CIService *service);
+void ci_service_invalidate_index(void);
 
-gboolean ci_service_check_command(const gchar *commandline)
+gpointer ci_service_slab_alloc(struct CIServiceSlab *slab)
 {
-    if (commandline == NULL || commandline[0] == 0)
-        return FALSE;
+    gpointer mem = slab->free;
 
-    gint ac;
-    gchar **av = NULL;
-    gchar *cmd = NULL;
+    if (mem == NULL)
+        return g_malloc0(slab->size);
 
-    if (!g_shell_parse_argv(commandline, &ac, &av, NULL) ||
-            (cmd = g_find_program_in_path(av[0])) == NULL) {
-        g_strfreev(av);
-        g_free(cmd);
-        return FALSE;
+    slab->free = *(gpointer *)mem;
+    --slab->n_free;
+    memset(mem, 0, slab->size);
+    return mem;
+}
+
+void ci_service_slab_free(struct CIServiceSlab *slab, gpointer mem)
+{
+    if (mem == NULL)
+        return;
+
+    if (slab->n_free >= slab->max_free) {
+        g_free(mem);
+        return;
     }
 
-    g_strfreev(av);
-    g_free(cmd);
-    return TRUE;
+    *(gpointer *)mem = slab->free;
+    slab->free = mem;
+    ++slab->n_free;
 }
 
-CIService *ci_service_add_service(const gchar *identifier, const gchar *commandline, gboolean active)
+void ci_service_slab_clear(struct CIServiceSlab *slab)
 {
-    if (!ci_service_check_command(commandline))
-        return NULL;
+    gpointer mem;
 
-    struct CIService *service = g_malloc0(sizeof(struct CIService));
-    service->identifier = g_strdup(identifier);
-    service->command = g_strdup(commandline);
-    service->active = active;
-    service->userid = -1;
+    while ((mem = slab->free) != NULL) {
+        slab->free = *(gpointer *)mem;
+        g_free(mem);
+    }
+    slab->n_free = 0;
+}
 
-    ci_services = g_list_append(ci_services, service);
+struct CIServiceCall *ci_service_call_alloc(gsize size)
+{
+    struct CIServiceCall *call;
 
-    return service;
+    if (size <= CI_SERVICE_CALL_ARENA) {
+        call = ci_service_slab_alloc(&ci_service_call_slab);
+        size = CI_SERVICE_CALL_ARENA;
+    }
+    else {
+        call = g_malloc0(sizeof(struct CIServiceCall) + size);
+    }
+    call->refcount = 1;
+    call->size = size;
+
+    return call;
 }
 
-GList *ci_service_list_services(void)
+/* values: CIServiceFieldCount strings, may be NULL */
+struct CIServiceCall *ci_service_call_new(const gchar * const *values)
 {
-    return g_list_copy(ci_services);
+    gsize lengths[CIServiceFieldCount];
+    gsize size = 0;
+    gsize used = 0;
+    guint i;
+
+    for (i = 0; i < CIServiceFieldCount; ++i) {
+        lengths[i] = values[i] ? strlen(values[i]) + 1 : 0;
+        size += lengths[i];
+    }
+
+    struct CIServiceCall *call = ci_service_call_alloc(size);
+    for (i = 0; i < CIServiceFieldCount; ++i) {
+        if (values[i] == NULL)
+            continue;
+        memcpy(call->arena + used, values[i], lengths[i]);
+        call->fields[i] = call->arena + used;
+        used += lengths[i];
+    }
+
+    return call;
 }
 
-gint ci_service_compare_identifier(struct CIService *service, const gchar *identifier)
+struct CIServiceCall *ci_service_call_ref(struct CIServiceCall *call)
 {
-    g_return_val_if_fail(service != NULL, -1);
+    g_atomic_int_inc(&call->refcount);
+    return call;
+}
 
-    return g_strcmp0(service->identifier, identifier);
+/* the last reference is dropped on the main loop */
+void ci_service_call_unref(struct CIServiceCall *call)
+{
+    if (call == NULL || !g_atomic_int_dec_and_test(&call->refcount))
+        return;
+
+    if (call->base)
+        ci_service_call_unref(call->base);
+    g_free(call->derived[0]);
+    g_free(call->derived[1]);
+    if (call->size == CI_SERVICE_CALL_ARENA)
+        ci_service_slab_free(&ci_service_call_slab, call);
+    else
+        g_free(call);
 }
 
-CIService *ci_service_get(const gchar *identifier)
+/* the fields of base with one replaced, e.g. the caller's name from a query */
+struct CIServiceCall *ci_service_call_with_field(struct CIServiceCall *base, CIServiceField field,
+                                                 const gchar *value)
 {
-    GList *result = g_list_find_custom(ci_services, identifier,
-            (GCompareFunc)ci_service_compare_identifier);
-    if (result != NULL)
-        return (struct CIService *)result->data;
+    gsize length = strlen(value) + 1;
+    struct CIServiceCall *call = ci_service_call_alloc(length);
 
-    return NULL;
+    memcpy(call->fields, base->fields, sizeof(call->fields));
+    memcpy(call->arena, value, length);
+    call->fields[field] = call->arena;
+    call->base = ci_service_call_ref(base);
+
+    return call;
 }
 
-const gchar *ci_service_get_identifier(CIService *service)
+gint ci_service_template_match_slot(const gchar *str, gsize *length)
 {
-    g_return_val_if_fail(service != NULL, NULL);
+    gint i;
+    gsize len;
 
-    return service->identifier;
+    for (i = 0; ci_service_placeholders[i] != NULL; ++i) {
+        len = strlen(ci_service_placeholders[i]);
+        if (strncmp(str, ci_service_placeholders[i], len) == 0) {
+            *length = len;
+            return i;
+        }
+    }
+
+    return -1;
 }
 
-const gchar *ci_service_get_commandline(CIService *service)
+guint32 ci_service_template_arg_fields(struct CIServiceTemplateArg *arg)
 {
-    g_return_val_if_fail(service != NULL, NULL);
+    guint32 fields = 0;
+    guint j;
 
-    return service->command;
+    for (j = 0; j < arg->n_segments; ++j) {
+        if (arg->segments[j].literal == NULL)
+            fields |= CI_SERVICE_FIELD_BIT(arg->segments[j].field);
+    }
+
+    return fields;
 }
 
-gboolean ci_service_get_active(CIService *service)
+/* seconds since the epoch for the call's date (2024-01-31 or 31.01.2024) and time, local time */
+gchar *ci_service_call_epoch(struct CIServiceCall *call)
 {
-    g_return_val_if_fail(service != NULL, FALSE);
+    const gchar *date = call->fields[CIServiceFieldDate];
+    const gchar *time = call->fields[CIServiceFieldTime];
+    gint year, month, day;
+    gint hour = 0, minute = 0, second = 0;
+    GDateTime *datetime;
+    gchar *epoch;
 
-    return service->active;
+    if (date == NULL ||
+            (sscanf(date, "%d-%d-%d", &year, &month, &day) != 3 &&
+             sscanf(date, "%d.%d.%d", &day, &month, &year) != 3))
+        return g_strdup("");
+    if (year < 100)
+        year += 2000;
+    if (time != NULL)
+        sscanf(time, "%d:%d:%d", &hour, &minute, &second);
+
+    datetime = g_date_time_new_local(year, month, day, hour, minute, second);
+    if (datetime == NULL)
+        return g_strdup("");
+    epoch = g_strdup_printf("%" G_GINT64_FORMAT, g_date_time_to_unix(datetime));
+    g_date_time_unref(datetime);
+
+    return epoch;
 }
 
-void ci_service_set_active(CIService *service, gboolean active)
+/* built from the date and time when first used and kept with the call; dispatch
+ * threads may race to build it, the first one wins */
+const gchar *ci_service_call_derived(struct CIServiceCall *call, CIServiceField field)
 {
-    g_return_if_fail(service != NULL);
+    gchar **slot = &call->derived[field == CIServiceFieldDatetime ? 0 : 1];
+    gchar *value = g_atomic_pointer_get(slot);
 
-    service->active = active;
+    if (value != NULL)
+        return value;
+
+    if (field == CIServiceFieldDatetime)
+        value = g_strdup_printf("%s %s",
+                call->fields[CIServiceFieldDate] ? call->fields[CIServiceFieldDate] : "",
+                call->fields[CIServiceFieldTime] ? call->fields[CIServiceFieldTime] : "");
+    else
+        value = ci_service_call_epoch(call);
+
+    if (!g_atomic_pointer_compare_and_exchange(slot, NULL, value)) {
+        g_free(value);
+        value = g_atomic_pointer_get(slot);
+    }
+
+    return value;
 }
 
-void ci_service_set_userid(CIService *service, gint userid)
+const gchar *ci_service_field_value(struct CIService *service, struct CIServiceCall *call, CIServiceField field)
 {
-    g_return_if_fail(service != NULL);
+    if (field == CIServiceFieldService)
+        return service->identifier;
+    if (field == CIServiceFieldDatetime || field == CIServiceFieldEpoch)
+        return ci_service_call_derived(call, field);
+    return call->fields[field];
+}
 
-    service->userid = userid;
+void ci_service_template_compile_arg(struct CIServiceTemplateArg *arg, const gchar *str)
+{
+    GArray *segments = g_array_new(FALSE, TRUE, sizeof(struct CIServiceTemplateSegment));
+    struct CIServiceTemplateSegment segment;
+    const gchar *start = str;
+    const gchar *pos;
+    gint field;
+    gsize len;
+
+    for (pos = str; *pos != 0; ) {
+        if (pos[0] == '$' && pos[1] == '{' &&
+                (field = ci_service_template_match_slot(pos, &len)) >= 0) {
+            segment.field = (CIServiceField)field;
+            if (pos > start) {
+                struct CIServiceTemplateSegment text = { g_strndup(start, pos - start), 0 };
+                g_array_append_val(segments, text);
+            }
+            segment.literal = NULL;
+            g_array_append_val(segments, segment);
+            pos += len;
+            start = pos;
+        }
+        else {
+            ++pos;
+        }
+    }
+    if (pos > start || segments->len == 0) {
+        struct CIServiceTemplateSegment text = { g_strndup(start, pos - start), 0 };
+        g_array_append_val(segments, text);
+    }
+
+    arg->n_segments = segments->len;
+    arg->segments = (struct CIServiceTemplateSegment *)g_array_free(segments, FALSE);
 }
 
-gint ci_service_get_userid(CIService *service)
+void ci_service_template_free(struct CIServiceTemplate *template)
 {
-    g_return_val_if_fail(service != NULL, -1);
+    if (template == NULL)
+        return;
 
-    return service->userid;
+    gint i;
+    guint j;
+    for (i = 0; i < template->argc; ++i) {
+        for (j = 0; j < template->args[i].n_segments; ++j)
+            g_free(template->args[i].segments[j].literal);
+        g_free(template->args[i].segments);
+    }
+    g_free(template->args);
+    g_free(template);
 }
 
-gboolean ci_service_regex_eval_cb(const GMatchInfo *info, GString *res, gpointer data)
+/* program: set to the first word of the command line */
+struct CIServiceTemplate *ci_service_template_compile(const gchar *commandline, gchar **program)
 {
-    gchar *match;
-    gchar *r;
+    if (commandline == NULL || commandline[0] == 0)
+        return NULL;
 
-    match = g_match_info_fetch(info, 0);
-    r = g_hash_table_lookup((GHashTable *)data, match);
+    gint ac;
+    gchar **av = NULL;
 
-    gchar *quoted = NULL;
-    
-    if (r != NULL)
-        quoted = g_shell_quote(r);
-    else
-        quoted = g_shell_quote("");
-    g_string_append(res, quoted);
-    g_free(quoted);
+    if (!g_shell_parse_argv(commandline, &ac, &av, NULL)) {
+        g_strfreev(av);
+        return NULL;
+    }
+    *program = g_strdup(av[0]);
 
-    g_free(match);
+    struct CIServiceTemplate *template = g_malloc0(sizeof(struct CIServiceTemplate));
+    template->argc = ac;
+    template->args = g_malloc0(sizeof(struct CIServiceTemplateArg) * ac);
 
-    return FALSE;
+    gint i;
+    for (i = 0; i < ac; ++i) {
+        ci_service_template_compile_arg(&template->args[i], av[i]);
+        template->fields |= ci_service_template_arg_fields(&template->args[i]);
+    }
+
+    g_strfreev(av);
+    return template;
 }
 
-struct _CIServiceQuery {
-    CIService *service;
-    GHashTable *hashtable;
-};
+void ci_service_template_append_arg(struct CIService *service, struct CIServiceTemplateArg *arg,
+                                    struct CIServiceCall *call, GString *str)
+{
+    const gchar *value;
+    guint j;
 
-void ci_service_query_caller_complete_cb(const gchar *name, struct _CIServiceQuery *querydata)
+    for (j = 0; j < arg->n_segments; ++j) {
+        if (arg->segments[j].literal != NULL) {
+            g_string_append(str, arg->segments[j].literal);
+        }
+        else {
+            value = ci_service_field_value(service, call, arg->segments[j].field);
+            if (value != NULL)
+                g_string_append(str, value);
+        }
+    }
+}
+
+gsize ci_service_template_arg_length(struct CIService *service, struct CIServiceTemplateArg *arg,
+                                     struct CIServiceCall *call)
 {
-    g_return_if_fail(querydata != NULL);
-    if (!querydata->service || !querydata->hashtable)
-        goto done;
+    const gchar *value;
+    gsize length = 0;
+    guint j;
+
+    for (j = 0; j < arg->n_segments; ++j) {
+        value = arg->segments[j].literal ? arg->segments[j].literal :
+            ci_service_field_value(service, call, arg->segments[j].field);
+        if (value != NULL)
+            length += strlen(value);
+    }
+
+    return length;
+}
+
+/* fill the slots; the vector and the expanded arguments are one block freed with g_free(),
+ * arguments without slots point into the template */
+gchar **ci_service_template_expand(struct CIService *service, struct CIServiceCall *call)
+{
+    struct CIServiceTemplate *template = service->template;
+    struct CIServiceTemplateArg *arg;
+    const gchar *value;
+    gsize size = sizeof(gchar *) * (template->argc + 1);
+    gchar **argv;
+    gchar *pos;
+    gint i;
+    guint j;
+    gsize len;
 
-    gchar *name_bkup = g_strdup(g_hash_table_lookup(querydata->hashtable, "${name}"));
-    if (name && name[0]) {
-        g_hash_table_replace(querydata->hashtable, "${name}", g_strdup(name));
+    for (i = 0; i < template->argc; ++i) {
+        arg = &template->args[i];
+        if (arg->n_segments != 1 || arg->segments[0].literal == NULL)
+            size += ci_service_template_arg_length(service, arg, call) + 1;
     }
 
-    gchar *cmd = g_regex_replace_eval(ci_service_regex, querydata->service->command,
-            -1, 0, 0, ci_service_regex_eval_cb, querydata->hashtable, NULL);
-    ci_service_run(cmd);
-    g_free(cmd);
+    argv = g_malloc(size);
+    pos = (gchar *)(argv + template->argc + 1);
 
-    if (name && name[0]) {
-        g_hash_table_replace(querydata->hashtable, "${name}", name_bkup);
+    for (i = 0; i < template->argc; ++i) {
+        arg = &template->args[i];
+        if (arg->n_segments == 1 && arg->segments[0].literal != NULL) {
+            argv[i] = arg->segments[0].literal;
+            continue;
+        }
+        argv[i] = pos;
+        for (j = 0; j < arg->n_segments; ++j) {
+            value = arg->segments[j].literal ? arg->segments[j].literal :
+                ci_service_field_value(service, call, arg->segments[j].field);
+            if (value == NULL)
+                continue;
+            len = strlen(value);
+            memcpy(pos, value, len);
+            pos += len;
+        }
+        *pos++ = 0;
     }
-done:
-    if (querydata->hashtable)
-        g_hash_table_unref(querydata->hashtable);
-    g_free(querydata);
+    argv[i] = NULL;
+
+    return argv;
 }
 
-void ci_service_run_commands(CICallInfo *callinfo, CIServiceQueryCallerCallback query_caller_cb, gpointer userdata)
+void ci_service_resolve_path(struct CIService *service);
+
+void ci_service_path_changed_cb(GFileMonitor *monitor, GFile *file, GFile *other_file,
+                                GFileMonitorEvent event, struct CIService *service)
 {
-    if (ci_services == NULL || callinfo == NULL)
+    /* a changes-done hint follows once the file is written */
+    if (event != G_FILE_MONITOR_EVENT_CHANGED)
+        ci_service_resolve_path(service);
+}
+
+void ci_service_unwatch_path(struct CIService *service)
+{
+    if (service->monitor == NULL)
         return;
+    g_signal_handlers_disconnect_by_data(service->monitor, service);
+    g_file_monitor_cancel(service->monitor);
+    g_object_unref(service->monitor);
+    service->monitor = NULL;
+}
+
+void ci_service_watch_path(struct CIService *service, const gchar *path)
+{
+    ci_service_unwatch_path(service);
+
+    GFile *file = g_file_new_for_path(path);
+    service->monitor = g_file_monitor_file(file, G_FILE_MONITOR_NONE, NULL, NULL);
+    g_object_unref(file);
+
+    if (service->monitor != NULL)
+        g_signal_connect(service->monitor, "changed", G_CALLBACK(ci_service_path_changed_cb), service);
+}
+
+/* look the program up in PATH once, jobs are spawned with the result; done again
+ * only when the monitor reports that the file changed or is gone */
+void ci_service_resolve_path(struct CIService *service)
+{
+    gchar *path = g_find_program_in_path(service->program);
 
-    gchar buffer[64];
-    GHashTable *hashtable = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, g_free);
-    g_hash_table_insert(hashtable, "${number}", g_strdup(callinfo->number));
-    g_hash_table_insert(hashtable, "${areacode}", g_strdup(callinfo->areacode));
-    g_hash_table_insert(hashtable, "${area}", g_strdup(callinfo->area));
-    g_hash_table_insert(hashtable, "${name}", g_strdup(callinfo->name));
-    snprintf(buffer, 32, "%s %s", callinfo->date, callinfo->time);
-    g_hash_table_insert(hashtable, "${time}", g_strdup(callinfo->time));
-    g_hash_table_insert(hashtable, "${msn}", g_strdup(callinfo->msn));
-    g_hash_table_insert(hashtable, "${alias}", g_strdup(callinfo->alias));
-    g_hash_table_insert(hashtable, "${completenumber}", g_strdup(callinfo->completenumber));
+    if (path == NULL) {
+        if (service->path != NULL)
+            fprintf(stderr, "Service `%s': `%s' is gone, calls fail until it is back.\n",
+                    service->identifier ? service->identifier : "<cmdline>", service->path);
+        /* keep watching the old path to notice the file coming back */
+        g_free(service->path);
+        service->path = NULL;
+        return;
+    }
 
-    if (G_UNLIKELY(ci_service_regex == NULL)) {
-        ci_service_regex =
-            g_regex_new("\\${number}|\\${areacode}|\\${area}|\\${name}|\\${time}|\\${msn}|\\${alias}|\\${completenumber}",
-                        G_REGEX_RAW, 0, NULL);
+    if (g_strcmp0(path, service->path) != 0) {
+        if (service->monitor != NULL)
+            fprintf(stderr, "Service `%s': running `%s' now.\n",
+                    service->identifier ? service->identifier : "<cmdline>", path);
+        if (ci_services_monitoring)
+            ci_service_watch_path(service, path);
     }
+    g_free(service->path);
+    service->path = path;
+}
 
+void ci_service_start_monitors(void)
+{
     GList *tmp;
-    struct _CIServiceQuery *querydata;
+    struct CIService *service;
+
+    ci_services_monitoring = TRUE;
     for (tmp = ci_services; tmp != NULL; tmp = g_list_next(tmp)) {
-        if (((struct CIService *)tmp->data)->active) {
-            querydata = g_malloc0(sizeof(struct _CIServiceQuery));
-            querydata->service = (struct CIService *)tmp->data;
-            querydata->hashtable = hashtable;
-            g_hash_table_ref(hashtable);
-            if (((struct CIService *)tmp->data)->userid != -1 &&
-                    query_caller_cb) {
-                query_caller_cb(callinfo->completenumber, ((struct CIService *)tmp->data)->userid, userdata,
-                        (CIServiceQueryCompleteCallback)ci_service_query_caller_complete_cb, querydata);
-            }
-            else {
-                ci_service_query_caller_complete_cb(NULL, querydata);
-            }
-        }
+        service = (struct CIService *)tmp->data;
+        if (service->type == CIServiceTypeCommand && service->path != NULL && service->monitor == NULL)
+            ci_service_watch_path(service, service->path);
+    }
+}
+
+CIService *ci_service_add_service(const gchar *identifier, const gchar *commandline, gboolean active)
+{
+    gchar *program = NULL;
+    struct CIServiceTemplate *template = ci_service_template_compile(commandline, &program);
+    if (template == NULL)
+        return NULL;
+
+    struct CIService *service = ci_service_new(identifier, commandline, active);
+    service->type = CIServiceTypeCommand;
+    service->template = template;
+    service->program = program;
+
+    ci_service_resolve_path(service);
+    if (service->path == NULL) {
+        ci_service_unref(service);
+        return NULL;
     }
 
-    g_hash_table_unref(hashtable);
+    ci_services = g_list_append(ci_services, service);
+    ci_service_invalidate_index();
+
+    return service;
 }
 
-void ci_service_free(struct CIService *service)
+void ci_service_plugin_free(struct CIServicePlugin *plugin)
 {
-    if (service != NULL) {
-        g_free(service->command);
-        g_free(service->identifier);
-        g_free(service);
+    if (plugin == NULL)
+        return;
+    if (plugin->cleanup)
+        plugin->cleanup(plugin->data);
+    if (plugin->module)
+        g_module_close(plugin->module);
+    g_free(plugin);
+}
+
+struct CIServicePlugin *ci_service_plugin_load(const gchar *identifier, const gchar *filename,
+                                               const gchar * const *options)
+{
+    if (!g_module_supported() || filename == NULL || filename[0] == 0)
+        return NULL;
+
+    struct CIServicePlugin *plugin = g_malloc0(sizeof(struct CIServicePlugin));
+    CIPluginGetAbiVersionFunc get_abi_version = NULL;
+    CIPluginInitFunc init = NULL;
+
+    plugin->module = g_module_open(filename, G_MODULE_BIND_LAZY | G_MODULE_BIND_LOCAL);
+    if (plugin->module == NULL) {
+        fprintf(stderr, "Could not load plugin `%s': %s\n", filename, g_module_error());
+        goto err;
+    }
+
+    if (!g_module_symbol(plugin->module, "ci_plugin_get_abi_version", (gpointer *)&get_abi_version) ||
+            get_abi_version == NULL || get_abi_version() != CI_PLUGIN_ABI_VERSION) {
+        fprintf(stderr, "Plugin `%s' has an incompatible interface.\n", filename);
+        goto err;
+    }
+    if (!g_module_symbol(plugin->module, "ci_plugin_handle_call", (gpointer *)&plugin->handle_call) ||
+            plugin->handle_call == NULL) {
+        fprintf(stderr, "Plugin `%s' does not handle calls.\n", filename);
+        goto err;
+    }
+    g_module_symbol(plugin->module, "ci_plugin_init", (gpointer *)&init);
+
+    if (init != NULL && !init(identifier, options, &plugin->data)) {
+        fprintf(stderr, "Plugin `%s' failed to initialize.\n", filename);
+        goto err;
     }
+    /* only clean up after a successful init */
+    g_module_symbol(plugin->module, "ci_plugin_cleanup", (gpointer *)&plugin->cleanup);
+
+    return plugin;
+
+err:
+    ci_service_plugin_free(plugin);
+    return NULL;
 }
 
-void ci_service_cleanup(void)
+CIService *ci_service_add_plugin(const gchar *identifier, const gchar *filename,
+                                 const gchar * const *options, gboolean active)
+{
+    struct CIServicePlugin *plugin = ci_service_plugin_load(identifier, filename, options);
+    if (plugin == NULL)
+        return NULL;
+
+    struct CIService *service = ci_service_new(identifier, filename, active);
+    service->type = CIServiceTypePlugin;
+    service->plugin = plugin;
+
+    ci_services = g_list_append(ci_services, service);
+    ci_service_invalidate_index();
+
+    return service;
+}
+
+void ci_service_logfile_close(struct CIServiceLogfile *logfile)
+{
+    if (logfile->fd != -1) {
+        close(logfile->fd);
+        logfile->fd = -1;
+    }
+}
+
+gboolean ci_service_logfile_open(struct CIServiceLogfile *logfile)
+{
+    struct stat st;
+
+    if (logfile->fd != -1)
+        return TRUE;
+
+    logfile->fd = open(logfile->filename, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (logfile->fd == -1) {
+        fprintf(stderr, "Could not open log file `%s': %s\n", logfile->filename, g_strerror(errno));
+        return FALSE;
+    }
+    logfile->size = fstat(logfile->fd, &st) == 0 ? st.st_size : 0;
+
+    return TRUE;
+}
+
+/* file -> file.1 -> … -> file.<rotate_count>, the oldest one is dropped */
+void ci_service_logfile_rotate(struct CIServiceLogfile *logfile)
 {
-    g_list_free_full(ci_services, (GDestroyNotify)ci_service_free);
-    if (ci_service_regex)
-        g_regex_unref(ci_service_regex);
+    gchar *from, *to;
+    guint i;
+
+    ci_service_logfile_close(logfile);
+
+    if (logfile->rotate_count == 0) {
+        unlink(logfile->filename);
+        return;
+    }
+
+    for (i = logfile->rotate_count; i > 1; --i) {
+        from = g_strdup_printf("%s.%u", logfile->filename, i - 1);
+        to = g_strdup_printf("%s.%u", logfile->filename, i);
+        rename(from, to);
+        g_free(from);
+        g_free(to);
+    }
+    to = g_strdup_printf("%s.1", logfile->filename);
+    rename(logfile->filename, to);
+    g_free(to);
 }
 
-void ci_service_run(const gchar *command)
+void ci_service_logfile_flush(struct CIServiceLogfile *logfile)
 {
-    gint argc = 0;
-    gchar **argv = NULL;
+    gsize done = 0;
+    gssize rc;
 
-    if (!g_shell_parse_argv(command, &argc, &argv, NULL))
+    if (logfile->buffer->len == 0 || !ci_service_logfile_open(logfile))
         return;
-    g_spawn_async(NULL, argv, NULL, G_SPAWN_SEARCH_PATH,
-            NULL, NULL, NULL, NULL);
-    g_strfreev(argv);
+
+    while (done < logfile->buffer->len) {
+        rc = write(logfile->fd, logfile->buffer->str + done, logfile->buffer->len - done);
+        if (rc < 0 && errno == EINTR)
+            continue;
+        if (rc <= 0) {
+            fprintf(stderr, "Could not write log file `%s': %s\n", logfile->filename, g_strerror(errno));
+            ci_service_logfile_close(logfile);
+            break;
+        }
+        done += rc;
+    }
+    logfile->size += done;
+    /* an unwritten tail is tried again with the next flush */
+    g_string_erase(logfile->buffer, 0, done);
+    if (logfile->buffer->len > 0) {
+        if (logfile->stats)
+            ci_stats_count(logfile->stats, CIStatsWriteFailed);
+        if (logfile->buffer->len > CI_SERVICE_LOGFILE_MAX_BUFFER) {
+            fprintf(stderr, "Log file `%s': dropping %" G_GSIZE_FORMAT " unwritten bytes.\n",
+                    logfile->filename, logfile->buffer->len);
+            g_string_truncate(logfile->buffer, 0);
+        }
+        return;
+    }
+
+    if (logfile->rotate_size > 0 && logfile->size >= logfile->rotate_size)
+        ci_service_logfile_rotate(logfile);
+}
+
+gboolean ci_service_logfile_flush_cb(struct CIServiceLogfile *logfile)
+{
+    ci_service_logfile_flush(logfile);
+    /* try an unwritten tail again */
+    if (logfile->buffer->len > 0)
+        return TRUE;
+    logfile->flush_source = 0;
+    return FALSE;
+}
+
+void ci_service_logfile_free(struct CIServiceLogfile *logfile)
+{
+    if (logfile == NULL)
+        return;
+    if (logfile->flush_source)
+        g_source_remove(logfile->flush_source);
+    ci_service_logfile_flush(logfile);
+    if (logfile->buffer->len > 0)
+        fprintf(stderr, "Log file `%s': dropping %" G_GSIZE_FORMAT " unwritten bytes.\n",
+                logfile->filename, logfile->buffer->len);
+    ci_service_logfile_close(logfile);
+
+    guint j;
+    for (j = 0; j < logfile->format.n_segments; ++j)
+        g_free(logfile->format.segments[j].literal);
+    g_free(logfile->format.segments);
+    g_string_free(logfile->buffer, TRUE);
+    g_free(logfile->filename);
+    g_free(logfile);
+}
+
+CIService *ci_service_add_logfile(const gchar *identifier, const gchar *filename,
+                                  const gchar *format, gboolean active)
+{
+    if (filename == NULL || filename[0] == 0)
+        return NULL;
+
+    struct CIServiceLogfile *logfile = g_malloc0(sizeof(struct CIServiceLogfile));
+    logfile->filename = g_strdup(filename);
+    logfile->fd = -1;
+    logfile->buffer = g_string_sized_new(4096);
+    logfile->flush_interval = 5;
+    logfile->flush_size = 4096;
+    logfile->rotate_count = 3;
+    ci_service_template_compile_arg(&logfile->format,
+            format ? format : CI_SERVICE_LOGFILE_DEFAULT_FORMAT);
+
+    if (!ci_service_logfile_open(logfile)) {
+        ci_service_logfile_free(logfile);
+        return NULL;
+    }
+
+    struct CIService *service = ci_service_new(identifier, filename, active);
+    service->type = CIServiceTypeLogfile;
+    service->logfile = logfile;
+    logfile->stats = service->stats;
+
+    ci_services = g_list_append(ci_services, service);
+    ci_service_invalidate_index();
+
+    return service;
+}
+
+void ci_service_set_logfile_flush(CIService *service, guint interval, gsize size)
+{
+    g_return_if_fail(service != NULL && service->logfile != NULL);
+
+    service->logfile->flush_interval = interval;
+    service->logfile->flush_size = size;
+}
+
+void ci_service_set_logfile_rotation(CIService *service, gsize size, guint count)
+{
+    g_return_if_fail(service != NULL && service->logfile != NULL);
+
+    service->logfile->rotate_size = size;
+    service->logfile->rotate_count = count;
+}
+
+struct CIService *ci_service_new(const gchar *identifier, const gchar *command, gboolean active)
+{
+    struct CIService *service = g_malloc0(sizeof(struct CIService));
+    service->identifier = g_strdup(identifier);
+    service->command = g_strdup(command);
+    service->active = active;
+    service->refcount = 1;
+    service->userid = -1;
+    service->max_concurrent = 4;
+    service->queue_depth = 64;
+    service->timeout = 0;
+    service->query_timeout = CI_SERVICE_QUERY_TIMEOUT;
+    service->overflow = CIServiceOverflowDropOldest;
+    service->rate_limit = CIServiceRateLimitDrop;
+    service->summary_interval = CI_SERVICE_SUMMARY_INTERVAL;
+    g_queue_init(&service->running);
+    g_queue_init(&service->pending);
+    g_queue_init(&service->work_ready);
+    service->stats = ci_stats_new();
+
+    return service;
+}
+
+GList *ci_service_list_services(void)
+{
+    return g_list_copy(ci_services);
+}
+
+gint ci_service_compare_identifier(struct CIService *service, const gchar *identifier)
+{
+    g_return_val_if_fail(service != NULL, -1);
+
+    return g_strcmp0(service->identifier, identifier);
+}
+
+CIService *ci_service_get(const gchar *identifier)
+{
+    GList *result = g_list_find_custom(ci_services, identifier,
+            (GCompareFunc)ci_service_compare_identifier);
+    if (result != NULL)
+        return (struct CIService *)result->data;
+
+    return NULL;
+}
+
+const gchar *ci_service_get_identifier(CIService *service)
+{
+    g_return_val_if_fail(service != NULL, NULL);
+
+    return service->identifier;
+}
+
+const gchar *ci_service_get_commandline(CIService *service)
+{
+    g_return_val_if_fail(service != NULL, NULL);
+
+    return service->command;
+}
+
+gboolean ci_service_get_active(CIService *service)
+{
+    g_return_val_if_fail(service != NULL, FALSE);
+
+    return service->active;
+}
+
+void ci_service_set_active(CIService *service, gboolean active)
+{
+    g_return_if_fail(service != NULL);
+
+    service->active = active;
+    /* the fields to copy depend on the active services */
+    ci_service_invalidate_index();
+}
+
+void ci_service_set_userid(CIService *service, gint userid)
+{
+    g_return_if_fail(service != NULL);
+
+    service->userid = userid;
+}
+
+gint ci_service_get_userid(CIService *service)
+{
+    g_return_val_if_fail(service != NULL, -1);
+
+    return service->userid;
+}
+
+void ci_service_add_filter(CIService *service, CIFilterField field, const gchar *value, gboolean exclude)
+{
+    g_return_if_fail(service != NULL);
+
+    if (service->filter == NULL)
+        service->filter = ci_filter_new();
+    ci_filter_add(service->filter, field, value, exclude);
+    ci_service_invalidate_index();
+}
+
+void ci_service_invalidate_index(void)
+{
+    ci_filter_index_free(ci_services_index);
+    ci_services_index = NULL;
+    if (ci_services_slots != NULL) {
+        g_ptr_array_free(ci_services_slots, TRUE);
+        ci_services_slots = NULL;
+    }
+}
+
+/* fields the service's command line, log format or input mode refers to */
+guint32 ci_service_get_fields(struct CIService *service)
+{
+    switch (service->type) {
+        case CIServiceTypePlugin:
+            return CI_SERVICE_RECORD_MASK;
+        case CIServiceTypeLogfile:
+            return ci_service_template_arg_fields(&service->logfile->format);
+        default:
+            if (service->input != CIServiceInputArgv ||
+                    service->batch_window > 0 || service->batch_max > 1)
+                return service->template->fields | CI_SERVICE_RECORD_MASK;
+            return service->template->fields;
+    }
+}
+
+void ci_service_update_index(void)
+{
+    if (ci_services_index != NULL)
+        return;
+
+    GList *tmp;
+    struct CIService *service;
+
+    /* the caller's number is needed for the queries */
+    ci_services_fields = CI_SERVICE_FIELD_BIT(CIServiceFieldCompletenumber);
+    ci_services_slots = g_ptr_array_new();
+    ci_services_index = ci_filter_index_new(g_list_length(ci_services));
+    for (tmp = ci_services; tmp != NULL; tmp = g_list_next(tmp)) {
+        service = (struct CIService *)tmp->data;
+        service->slot = ci_services_slots->len;
+        g_ptr_array_add(ci_services_slots, service);
+        ci_filter_index_add(ci_services_index, service->slot, service->filter);
+        if (service->active)
+            ci_services_fields |= ci_service_get_fields(service);
+    }
+    /* derived from the date and time when a service expands them */
+    if (ci_services_fields & (CI_SERVICE_FIELD_BIT(CIServiceFieldDatetime) | CI_SERVICE_FIELD_BIT(CIServiceFieldEpoch)))
+        ci_services_fields |= CI_SERVICE_FIELD_BIT(CIServiceFieldDate) | CI_SERVICE_FIELD_BIT(CIServiceFieldTime);
+}
+
+void ci_service_set_max_concurrent(CIService *service, gint max_concurrent)
+{
+    g_return_if_fail(service != NULL);
+
+    service->max_concurrent = max_concurrent;
+}
+
+void ci_service_set_queue_depth(CIService *service, gint queue_depth)
+{
+    g_return_if_fail(service != NULL);
+
+    service->queue_depth = queue_depth;
+}
+
+void ci_service_set_timeout(CIService *service, gint timeout)
+{
+    g_return_if_fail(service != NULL);
+
+    service->timeout = timeout;
+}
+
+void ci_service_set_query_timeout(CIService *service, gint timeout)
+{
+    g_return_if_fail(service != NULL);
+
+    service->query_timeout = timeout;
+}
+
+void ci_service_set_overflow_policy(CIService *service, CIServiceOverflowPolicy policy)
+{
+    g_return_if_fail(service != NULL);
+
+    service->overflow = policy;
+}
+
+gboolean ci_service_overflow_policy_from_string(const gchar *str, CIServiceOverflowPolicy *policy)
+{
+    if (str == NULL || policy == NULL)
+        return FALSE;
+
+    if (g_strcmp0(str, "drop-oldest") == 0)
+        *policy = CIServiceOverflowDropOldest;
+    else if (g_strcmp0(str, "drop-newest") == 0)
+        *policy = CIServiceOverflowDropNewest;
+    else if (g_strcmp0(str, "coalesce") == 0)
+        *policy = CIServiceOverflowCoalesce;
+    else
+        return FALSE;
+
+    return TRUE;
+}
+
+void ci_service_run_plugin(struct CIService *service, struct CIServiceCall *values)
+{
+    CIPluginCall call;
+
+    memset(&call, 0, sizeof(CIPluginCall));
+    call.struct_size = sizeof(CIPluginCall);
+    call.service = service->identifier;
+    call.completenumber = values->fields[CIServiceFieldCompletenumber];
+    call.number = values->fields[CIServiceFieldNumber];
+    call.areacode = values->fields[CIServiceFieldAreacode];
+    call.area = values->fields[CIServiceFieldArea];
+    call.name = values->fields[CIServiceFieldName];
+    call.date = values->fields[CIServiceFieldDate];
+    call.time = values->fields[CIServiceFieldTime];
+    call.msn = values->fields[CIServiceFieldMsn];
+    call.alias = values->fields[CIServiceFieldAlias];
+
+    service->plugin->handle_call(&call, service->plugin->data);
+}
+
+void ci_service_run_logfile(struct CIService *service, struct CIServiceCall *call)
+{
+    struct CIServiceLogfile *logfile = service->logfile;
+
+    ci_service_template_append_arg(service, &logfile->format, call, logfile->buffer);
+    g_string_append_c(logfile->buffer, '\n');
+
+    if (logfile->buffer->len >= logfile->flush_size || logfile->flush_interval == 0) {
+        if (logfile->flush_source) {
+            g_source_remove(logfile->flush_source);
+            logfile->flush_source = 0;
+        }
+        ci_service_logfile_flush(logfile);
+    }
+    /* also retries a failed flush */
+    if (logfile->buffer->len > 0 && logfile->flush_interval > 0 && logfile->flush_source == 0) {
+        logfile->flush_source = g_timeout_add_seconds(logfile->flush_interval,
+                (GSourceFunc)ci_service_logfile_flush_cb, logfile);
+    }
+}
+
+/* value with characters that would break the record replaced by blanks */
+void ci_service_append_plain(GString *record, const gchar *value, gboolean tabs)
+{
+    const gchar *c;
+
+    for (c = value; c != NULL && *c != 0; ++c) {
+        if (*c == '\n' || *c == '\r' || (tabs && *c == '\t'))
+            g_string_append_c(record, ' ');
+        else
+            g_string_append_c(record, *c);
+    }
+}
+
+void ci_service_append_json_string(GString *record, const gchar *value)
+{
+    const gchar *c;
+
+    g_string_append_c(record, '"');
+    for (c = value; c != NULL && *c != 0; ++c) {
+        switch (*c) {
+            case '"':
+                g_string_append(record, "\\\"");
+                break;
+            case '\\':
+                g_string_append(record, "\\\\");
+                break;
+            case '\n':
+                g_string_append(record, "\\n");
+                break;
+            case '\r':
+                g_string_append(record, "\\r");
+                break;
+            case '\t':
+                g_string_append(record, "\\t");
+                break;
+            default:
+                if ((guchar)*c < 0x20)
+                    g_string_append_printf(record, "\\u%04x", (guchar)*c);
+                else
+                    g_string_append_c(record, *c);
+        }
+    }
+    g_string_append_c(record, '"');
+}
+
+/* one record per call in the format of the service's input mode:
+ * stdin-json: one JSON object per line
+ * stdin-kv: key=value lines, records separated by an empty line
+ * otherwise: one line, fields separated by tabs */
+void ci_service_append_record(struct CIService *service, GString *record, struct CIServiceCall *call)
+{
+    const gchar *value;
+    guint i;
+
+    if (service->input == CIServiceInputStdinJson) {
+        g_string_append(record, "{\"service\":");
+        ci_service_append_json_string(record, service->identifier);
+        for (i = 0; i < CI_SERVICE_RECORD_FIELDS; ++i) {
+            g_string_append_printf(record, ",\"%s\":", ci_service_record_fields[i].key);
+            value = call->fields[i];
+            ci_service_append_json_string(record, value);
+        }
+        g_string_append(record, "}\n");
+    }
+    else if (service->input == CIServiceInputStdinKeyValue) {
+        if (record->len > 0)
+            g_string_append_c(record, '\n');
+        g_string_append(record, "service=");
+        ci_service_append_plain(record, service->identifier, FALSE);
+        g_string_append_c(record, '\n');
+        for (i = 0; i < CI_SERVICE_RECORD_FIELDS; ++i) {
+            g_string_append_printf(record, "%s=", ci_service_record_fields[i].key);
+            value = call->fields[i];
+            ci_service_append_plain(record, value, FALSE);
+            g_string_append_c(record, '\n');
+        }
+    }
+    else {
+        for (i = 0; i < CI_SERVICE_RECORD_FIELDS; ++i) {
+            if (i > 0)
+                g_string_append_c(record, '\t');
+            value = call->fields[i];
+            ci_service_append_plain(record, value, TRUE);
+        }
+        g_string_append_c(record, '\n');
+    }
+}
+
+/* CI_* variables for the env input mode, added to the daemon's environment;
+ * one block freed with g_free() */
+gchar **ci_service_build_env(struct CIService *service, struct CIServiceCall *call)
+{
+    const gchar *identifier = service->identifier ? service->identifier : "";
+    const gchar *suppressed = call->fields[CIServiceFieldSuppressed];
+    gsize size = sizeof(gchar *) * (CI_SERVICE_RECORD_FIELDS + 3);
+    gchar **env;
+    gchar *pos;
+    guint i;
+
+    for (i = 0; i < CI_SERVICE_RECORD_FIELDS; ++i)
+        size += strlen(ci_service_record_fields[i].env) + 2 + (call->fields[i] ? strlen(call->fields[i]) : 0);
+    size += strlen("CI_SERVICE=") + strlen(identifier) + 1;
+    if (suppressed)
+        size += strlen("CI_SUPPRESSED=") + strlen(suppressed) + 1;
+
+    env = g_malloc(size);
+    pos = (gchar *)(env + CI_SERVICE_RECORD_FIELDS + 3);
+    for (i = 0; i < CI_SERVICE_RECORD_FIELDS; ++i) {
+        env[i] = pos;
+        pos = g_stpcpy(pos, ci_service_record_fields[i].env);
+        *pos++ = '=';
+        pos = g_stpcpy(pos, call->fields[i] ? call->fields[i] : "") + 1;
+    }
+    env[i++] = pos;
+    pos = g_stpcpy(g_stpcpy(pos, "CI_SERVICE="), identifier) + 1;
+    if (suppressed) {
+        env[i++] = pos;
+        pos = g_stpcpy(g_stpcpy(pos, "CI_SUPPRESSED="), suppressed) + 1;
+    }
+    env[i] = NULL;
+
+    return env;
+}
+
+void ci_service_work_submit(struct CIService *service, struct CIServiceCall *call, GPtrArray *batch,
+                            GSList *spool, gint64 ring_time);
+
+void ci_service_batch_flush(struct CIService *service)
+{
+    if (service->batch_source) {
+        g_source_remove(service->batch_source);
+        service->batch_source = 0;
+    }
+    if (service->batch_count == 0)
+        return;
+
+    GPtrArray *batch = service->batch_values;
+    GSList *spool = service->batch_spool;
+    gint64 ring_time = service->batch_ring_time;
+
+    service->batch_values = NULL;
+    service->batch_spool = NULL;
+    service->batch_count = 0;
+
+    ci_service_work_submit(service, NULL, batch, spool, ring_time);
+    ci_service_unref(service);
+}
+
+gboolean ci_service_batch_timeout_cb(struct CIService *service)
+{
+    service->batch_source = 0;
+    ci_service_batch_flush(service);
+    return FALSE;
+}
+
+void ci_service_batch_add(struct CIService *service, struct CIServiceCall *call, gint64 ring_time,
+                          CISpoolEntry *spool)
+{
+    if (service->batch_count == 0) {
+        ci_service_ref(service);
+        service->batch_ring_time = ring_time;
+        service->batch_values = g_ptr_array_new_with_free_func((GDestroyNotify)ci_service_call_unref);
+        service->batch_source = g_timeout_add_seconds(service->batch_window,
+                (GSourceFunc)ci_service_batch_timeout_cb, service);
+    }
+
+    g_ptr_array_add(service->batch_values, ci_service_call_ref(call));
+    if (spool != NULL)
+        service->batch_spool = g_slist_prepend(service->batch_spool, spool);
+    ++service->batch_count;
+
+    if (service->batch_max > 0 && service->batch_count >= service->batch_max)
+        ci_service_batch_flush(service);
+}
+
+void ci_service_set_input_mode(CIService *service, CIServiceInputMode mode)
+{
+    g_return_if_fail(service != NULL);
+
+    ci_service_batch_flush(service);
+    service->input = mode;
+    ci_service_invalidate_index();
+}
+
+gboolean ci_service_input_mode_from_string(const gchar *str, CIServiceInputMode *mode)
+{
+    if (str == NULL || mode == NULL)
+        return FALSE;
+
+    if (g_strcmp0(str, "argv") == 0)
+        *mode = CIServiceInputArgv;
+    else if (g_strcmp0(str, "env") == 0)
+        *mode = CIServiceInputEnv;
+    else if (g_strcmp0(str, "stdin-json") == 0)
+        *mode = CIServiceInputStdinJson;
+    else if (g_strcmp0(str, "stdin-kv") == 0)
+        *mode = CIServiceInputStdinKeyValue;
+    else
+        return FALSE;
+
+    return TRUE;
+}
+
+void ci_service_set_batch(CIService *service, gint window, gint max)
+{
+    g_return_if_fail(service != NULL);
+
+    ci_service_batch_flush(service);
+    /* a partial batch is always flushed eventually */
+    if (window <= 0 && max > 1)
+        window = CI_SERVICE_BATCH_WINDOW;
+    service->batch_window = window;
+    service->batch_max = max;
+    ci_service_invalidate_index();
+}
+
+void ci_service_work_free(struct CIServiceWork *work)
+{
+    ci_service_call_unref(work->call);
+    if (work->batch)
+        g_ptr_array_unref(work->batch);
+    ci_service_unref(work->service);
+    ci_service_slab_free(&ci_service_work_slab, work);
+}
+
+/* may run in a dispatch thread */
+void ci_service_work_expand(struct CIServiceWork *work)
+{
+    struct CIService *service = work->service;
+    struct CIServiceCall *call = work->batch ? g_ptr_array_index(work->batch, 0) : work->call;
+    guint i;
+
+    work->argv = ci_service_template_expand(service, call);
+    if (service->input == CIServiceInputEnv)
+        work->env = ci_service_build_env(service, call);
+
+    if (work->batch) {
+        work->input = g_string_sized_new(256 * work->batch->len);
+        for (i = 0; i < work->batch->len; ++i)
+            ci_service_append_record(service, work->input, g_ptr_array_index(work->batch, i));
+    }
+    else if (service->input == CIServiceInputStdinJson || service->input == CIServiceInputStdinKeyValue) {
+        work->input = g_string_sized_new(256);
+        ci_service_append_record(service, work->input, call);
+    }
+}
+
+/* expanded but not run, its calls stay in the spool; only on shutdown */
+void ci_service_work_forget(struct CIServiceWork *work)
+{
+    g_free(work->argv);
+    g_free(work->env);
+    if (work->input)
+        g_string_free(work->input, TRUE);
+    g_slist_free(work->spool);
+    ci_service_work_free(work);
+}
+
+void ci_service_work_finish(struct CIServiceWork *work)
+{
+    struct CIService *service = work->service;
+
+    ++service->work_finished;
+    ci_stats_record(service->stats, CIStatsLatencyExpand, work->dispatch_time, g_get_monotonic_time());
+    ci_service_run(service, work->argv, work->env, work->input, work->ring_time, work->spool);
+    ci_service_work_free(work);
+}
+
+gint ci_service_work_compare_seq(struct CIServiceWork *a, struct CIServiceWork *b, gpointer userdata)
+{
+    return a->seq < b->seq ? -1 : (a->seq > b->seq ? 1 : 0);
+}
+
+/* back on the main loop; threads finish in any order, so a work waits for the
+ * service's earlier ones */
+void ci_service_work_ready(struct CIServiceWork *work)
+{
+    struct CIService *service = ci_service_ref(work->service);
+
+    if (work->seq != service->work_finished) {
+        g_queue_insert_sorted(&service->work_ready, work,
+                (GCompareDataFunc)ci_service_work_compare_seq, NULL);
+    }
+    else {
+        ci_service_work_finish(work);
+        while (service->work_ready.head != NULL &&
+                ((struct CIServiceWork *)service->work_ready.head->data)->seq == service->work_finished)
+            ci_service_work_finish((struct CIServiceWork *)g_queue_pop_head(&service->work_ready));
+    }
+
+    ci_service_unref(service);
+}
+
+gboolean ci_service_work_expanded_cb(gpointer userdata)
+{
+    struct CIServiceWork *work;
+
+    while ((work = g_async_queue_try_pop(ci_services_expanded)) != NULL)
+        ci_service_work_ready(work);
+
+    return FALSE;
+}
+
+void ci_service_work_thread(struct CIServiceWork *work, gpointer userdata)
+{
+    ci_service_work_expand(work);
+    g_async_queue_push(ci_services_expanded, work);
+    g_idle_add_full(G_PRIORITY_DEFAULT, ci_service_work_expanded_cb, &ci_services_expanded, NULL);
+}
+
+/* call or batch: calls, not changed afterwards; takes ownership of batch and spool */
+void ci_service_work_submit(struct CIService *service, struct CIServiceCall *call, GPtrArray *batch,
+                            GSList *spool, gint64 ring_time)
+{
+    struct CIServiceWork *work = ci_service_slab_alloc(&ci_service_work_slab);
+    work->service = ci_service_ref(service);
+    work->call = call ? ci_service_call_ref(call) : NULL;
+    work->batch = batch;
+    work->spool = spool;
+    work->ring_time = ring_time;
+    work->dispatch_time = g_get_monotonic_time();
+    work->seq = service->work_submitted++;
+
+    if (ci_services_dispatch != NULL &&
+            g_thread_pool_push(ci_services_dispatch, work, NULL))
+        return;
+
+    ci_service_work_expand(work);
+    ci_service_work_ready(work);
+}
+
+void ci_service_run_command(struct CIService *service, struct CIServiceCall *call, gint64 ring_time,
+                            CISpoolEntry *spool)
+{
+    ci_service_work_submit(service, call, NULL, spool ? g_slist_prepend(NULL, spool) : NULL, ring_time);
+}
+
+/* wait for the threads to expand what they have; run: run the results, else forget them */
+void ci_service_work_drain(gboolean run)
+{
+    struct CIServiceWork *work;
+
+    if (ci_services_dispatch == NULL)
+        return;
+
+    g_thread_pool_free(ci_services_dispatch, FALSE, TRUE);
+    ci_services_dispatch = NULL;
+
+    while (g_source_remove_by_user_data(&ci_services_expanded))
+        ;
+    while ((work = g_async_queue_try_pop(ci_services_expanded)) != NULL) {
+        if (run)
+            ci_service_work_ready(work);
+        else
+            ci_service_work_forget(work);
+    }
+    g_async_queue_unref(ci_services_expanded);
+    ci_services_expanded = NULL;
+}
+
+void ci_service_set_dispatch_threads(gint threads)
+{
+    if (threads <= 0) {
+        ci_service_work_drain(TRUE);
+        return;
+    }
+
+    if (ci_services_dispatch == NULL) {
+        ci_services_expanded = g_async_queue_new();
+        ci_services_dispatch = g_thread_pool_new((GFunc)ci_service_work_thread, NULL,
+                threads, FALSE, NULL);
+    }
+    else
+        g_thread_pool_set_max_threads(ci_services_dispatch, threads, NULL);
+}
+
+struct _CIServiceQuery {
+    CIService *service;
+    struct CIServiceCall *call;
+    CISpoolEntry *spool; /* handed on to the job running the call */
+    gint64 ring_time;
+    gint64 query_time;
+    guint timeout_source;
+    gpointer userdata;  /* of the query callback */
+    gboolean expired; /* ran without the reply, which is discarded when it comes */
+};
+
+struct CIServiceSlab ci_service_query_slab = { sizeof(struct _CIServiceQuery), 256, 0, NULL };
+
+/* spool is done once the call is handled */
+void ci_service_dispatch(struct CIService *service, struct CIServiceCall *call, gint64 ring_time,
+                         CISpoolEntry *spool)
+{
+    if (service->type == CIServiceTypePlugin) {
+        ci_service_run_plugin(service, call);
+        ci_stats_record(service->stats, CIStatsLatencyDispatch, ring_time, g_get_monotonic_time());
+        ci_spool_done(spool);
+    }
+    else if (service->type == CIServiceTypeLogfile) {
+        ci_service_run_logfile(service, call);
+        ci_stats_record(service->stats, CIStatsLatencyDispatch, ring_time, g_get_monotonic_time());
+        ci_spool_done(spool);
+    }
+    else if (service->batch_window > 0 || service->batch_max > 1) {
+        ci_service_batch_add(service, call, ring_time, spool);
+    }
+    else {
+        ci_service_run_command(service, call, ring_time, spool);
+    }
+}
+
+/* take a token for a call; FALSE if the service is over its rate */
+gboolean ci_service_rate_limit_take(struct CIService *service)
+{
+    if (service->rate <= 0)
+        return TRUE;
+
+    gint64 now = g_get_monotonic_time();
+    service->tokens += (now - service->refill_time) * service->rate / (60.0 * G_USEC_PER_SEC);
+    if (service->tokens > service->burst)
+        service->tokens = service->burst;
+    service->refill_time = now;
+
+    if (service->tokens < 1.0)
+        return FALSE;
+
+    service->tokens -= 1.0;
+    return TRUE;
+}
+
+/* run the service once for the calls suppressed since the last summary */
+void ci_service_summary_flush(struct CIService *service)
+{
+    if (service->summary_source) {
+        g_source_remove(service->summary_source);
+        service->summary_source = 0;
+    }
+    if (service->suppressed_call == NULL)
+        return;
+
+    gchar count[16];
+    g_snprintf(count, sizeof(count), "%u", service->suppressed);
+    struct CIServiceCall *call = ci_service_call_with_field(service->suppressed_call,
+            CIServiceFieldSuppressed, count);
+
+    ci_service_call_unref(service->suppressed_call);
+    service->suppressed_call = NULL;
+    service->suppressed = 0;
+
+    ci_stats_count(service->stats, CIStatsSummaries);
+    ci_service_dispatch(service, call, g_get_monotonic_time(), NULL);
+    ci_service_call_unref(call);
+    ci_service_unref(service);
+}
+
+gboolean ci_service_summary_timeout_cb(struct CIService *service)
+{
+    service->summary_source = 0;
+    ci_service_summary_flush(service);
+    return FALSE;
+}
+
+void ci_service_suppress(struct CIService *service, struct CIServiceCall *call)
+{
+    ci_stats_count(service->stats, CIStatsRateLimited);
+    if (service->rate_limit != CIServiceRateLimitSummary || !service->active)
+        return;
+
+    if (service->suppressed_call == NULL) {
+        ci_service_ref(service);
+        service->summary_source = g_timeout_add_seconds(service->summary_interval,
+                (GSourceFunc)ci_service_summary_timeout_cb, service);
+    }
+    else {
+        ci_service_call_unref(service->suppressed_call);
+    }
+    service->suppressed_call = ci_service_call_ref(call);
+    ++service->suppressed;
+}
+
+void ci_service_set_rate_limit(CIService *service, gdouble rate, gint burst,
+                               CIServiceRateLimitPolicy policy, gint interval)
+{
+    g_return_if_fail(service != NULL);
+
+    ci_service_summary_flush(service);
+    service->rate = rate;
+    service->burst = MAX(burst, 1);
+    service->tokens = service->burst;
+    service->refill_time = g_get_monotonic_time();
+    service->rate_limit = policy;
+    service->summary_interval = interval > 0 ? interval : CI_SERVICE_SUMMARY_INTERVAL;
+}
+
+gboolean ci_service_rate_limit_policy_from_string(const gchar *str, CIServiceRateLimitPolicy *policy)
+{
+    if (str == NULL || policy == NULL)
+        return FALSE;
+
+    if (g_strcmp0(str, "drop") == 0)
+        *policy = CIServiceRateLimitDrop;
+    else if (g_strcmp0(str, "summary") == 0)
+        *policy = CIServiceRateLimitSummary;
+    else
+        return FALSE;
+
+    return TRUE;
+}
+
+void ci_service_query_dispatch(struct _CIServiceQuery *querydata, const gchar *name)
+{
+    if (!querydata->service || !querydata->call)
+        return;
+
+    struct CIService *service = querydata->service;
+    gint64 reply_time = g_get_monotonic_time();
+    ci_stats_record(service->stats, CIStatsLatencyQuery, querydata->query_time, reply_time);
+
+    /* the call may still be read by dispatch threads, so the name goes into a new one */
+    struct CIServiceCall *call = querydata->call;
+    if (name && name[0])
+        call = ci_service_call_with_field(querydata->call, CIServiceFieldName, name);
+
+    ci_service_dispatch(service, call, querydata->ring_time, querydata->spool);
+    querydata->spool = NULL;
+
+    if (call != querydata->call)
+        ci_service_call_unref(call);
+}
+
+void ci_service_query_release(struct _CIServiceQuery *querydata)
+{
+    /* plugins and log files are done once dispatched */
+    ci_spool_done(querydata->spool);
+    ci_service_call_unref(querydata->call);
+    if (querydata->service)
+        ci_service_unref(querydata->service);
+    querydata->call = NULL;
+    querydata->service = NULL;
+}
+
+void ci_service_query_caller_complete_cb(const gchar *name, struct _CIServiceQuery *querydata)
+{
+    g_return_if_fail(querydata != NULL);
+
+    if (!querydata->expired) {
+        if (querydata->timeout_source)
+            g_source_remove(querydata->timeout_source);
+        ci_service_query_dispatch(querydata, name);
+        ci_service_query_release(querydata);
+    }
+    ci_service_slab_free(&ci_service_query_slab, querydata);
+}
+
+void ci_service_set_query_cancel(CIServiceQueryCancelCallback cancel_cb)
+{
+    ci_services_query_cancel = cancel_cb;
+}
+
+/* no reply in time, run with the name from the call info */
+gboolean ci_service_query_timeout_cb(struct _CIServiceQuery *querydata)
+{
+    querydata->timeout_source = 0;
+    querydata->expired = TRUE;
+    if (querydata->service)
+        ci_stats_count(querydata->service->stats, CIStatsQueryTimeouts);
+    ci_service_query_dispatch(querydata, NULL);
+
+    /* the reply will not find the record, so it can go now */
+    gboolean cancelled = FALSE;
+    if (ci_services_query_cancel && querydata->service && querydata->call) {
+        ci_services_query_cancel(querydata->call->fields[CIServiceFieldCompletenumber],
+                querydata->service->userid, querydata->userdata, querydata);
+        cancelled = TRUE;
+    }
+    ci_service_query_release(querydata);
+    if (cancelled)
+        ci_service_slab_free(&ci_service_query_slab, querydata);
+
+    return FALSE;
+}
+
+void ci_service_dispatch_call(struct CIService *service, struct CIServiceCall *call, gint64 ring_time,
+                              CISpoolEntry *spool, CIServiceQueryCallerCallback query_caller_cb,
+                              gpointer userdata)
+{
+    ci_stats_count(service->stats, CIStatsCalls);
+
+    /* over the rate: no query, a summary runs with the name of the call info */
+    if (!ci_service_rate_limit_take(service)) {
+        ci_service_suppress(service, call);
+        ci_spool_done(spool);
+        return;
+    }
+
+    struct _CIServiceQuery *querydata = ci_service_slab_alloc(&ci_service_query_slab);
+    querydata->service = ci_service_ref(service);
+    querydata->call = ci_service_call_ref(call);
+    querydata->ring_time = ring_time;
+    querydata->spool = spool;
+    querydata->userdata = userdata;
+    if (service->userid != -1 && query_caller_cb) {
+        querydata->query_time = g_get_monotonic_time();
+        if (service->query_timeout > 0)
+            querydata->timeout_source = g_timeout_add(service->query_timeout,
+                    (GSourceFunc)ci_service_query_timeout_cb, querydata);
+        query_caller_cb(call->fields[CIServiceFieldCompletenumber], service->userid, userdata,
+                (CIServiceQueryCompleteCallback)ci_service_query_caller_complete_cb, querydata);
+    }
+    else {
+        ci_service_query_caller_complete_cb(NULL, querydata);
+    }
+}
+
+CISpoolEntry *ci_service_spool_append(const gchar *server, struct CIService *service, struct CIServiceCall *call)
+{
+    const gchar *keys[CIServiceFieldCount];
+    guint i;
+
+    if (!ci_spool_is_open())
+        return NULL;
+
+    for (i = 0; i < CIServiceFieldCount; ++i)
+        keys[i] = ci_service_placeholders[i];
+
+    return ci_spool_append(server, service->identifier, keys, call->fields, CIServiceFieldCount);
+}
+
+/* only the fields in mask are set */
+struct CIServiceCall *ci_service_call_new_from_callinfo(CICallInfo *callinfo, guint32 mask)
+{
+    const gchar *values[CIServiceFieldCount];
+    guint i;
+
+    values[CIServiceFieldCompletenumber] = callinfo->completenumber;
+    values[CIServiceFieldNumber] = callinfo->number;
+    values[CIServiceFieldAreacode] = callinfo->areacode;
+    values[CIServiceFieldArea] = callinfo->area;
+    values[CIServiceFieldName] = callinfo->name;
+    values[CIServiceFieldDate] = callinfo->date;
+    values[CIServiceFieldTime] = callinfo->time;
+    values[CIServiceFieldMsn] = callinfo->msn;
+    values[CIServiceFieldAlias] = callinfo->alias;
+    values[CIServiceFieldDatetime] = NULL;
+    values[CIServiceFieldEpoch] = NULL;
+    values[CIServiceFieldService] = NULL;
+    values[CIServiceFieldSuppressed] = NULL;
+
+    for (i = 0; i < CIServiceFieldCount; ++i) {
+        if (!(mask & CI_SERVICE_FIELD_BIT(i)))
+            values[i] = NULL;
+    }
+
+    return ci_service_call_new(values);
+}
+
+void ci_service_run_commands(const gchar *server, CICallInfo *callinfo,
+                             CIServiceQueryCallerCallback query_caller_cb, gpointer userdata)
+{
+    if (ci_services == NULL || callinfo == NULL)
+        return;
+
+    gint64 ring_time = g_get_monotonic_time();
+    ci_stats_count(ci_stats_get_global(), CIStatsRings);
+
+    struct CIServiceCall *call;
+    struct CIService *service;
+    const guint64 *slots;
+    guint i;
+
+    /* only services whose filters pass the call */
+    ci_service_update_index();
+    slots = ci_filter_index_match(ci_services_index, server, callinfo);
+
+    call = ci_service_call_new_from_callinfo(callinfo, ci_services_fields);
+
+    for (i = 0; i < ci_services_slots->len; ++i) {
+        if (i % 64 == 0 && slots[i / 64] == 0) {
+            i += 63;
+            continue;
+        }
+        if (!(slots[i / 64] & (G_GUINT64_CONSTANT(1) << (i % 64))))
+            continue;
+        service = (struct CIService *)g_ptr_array_index(ci_services_slots, i);
+        if (service->active)
+            ci_service_dispatch_call(service, call, ring_time,
+                    ci_service_spool_append(server, service, call),
+                    query_caller_cb, userdata);
+    }
+
+    ci_service_call_unref(call);
+}
+
+void ci_service_replay(CISpoolEntry *entry, const gchar *server, const gchar *identifier, GHashTable *values,
+                       CIServiceQueryCallerCallback query_caller_cb, gpointer userdata)
+{
+    GList *result = g_list_find_custom(ci_services, identifier, (GCompareFunc)ci_service_compare_identifier);
+    struct CIService *service = result ? (struct CIService *)result->data : NULL;
+    guint i;
+
+    if (service == NULL || !service->active) {
+        ci_spool_done(entry);
+        return;
+    }
+
+    fprintf(stderr, "Replaying unfinished call from %s for service `%s'.\n",
+            server && server[0] ? server : "<default>", identifier);
+
+    const gchar *fields[CIServiceFieldCount];
+    for (i = 0; i < CIServiceFieldCount; ++i)
+        fields[i] = i == CIServiceFieldService ? NULL : g_hash_table_lookup(values, ci_service_placeholders[i]);
+
+    struct CIServiceCall *call = ci_service_call_new(fields);
+    ci_service_dispatch_call(service, call, g_get_monotonic_time(), entry, query_caller_cb, userdata);
+    ci_service_call_unref(call);
+}
+
+void ci_service_prefetch(const gchar *server, CICallInfo *callinfo,
+                         CIServiceQueryCallerCallback prefetch_cb, gpointer userdata)
+{
+    if (ci_services == NULL || callinfo == NULL || prefetch_cb == NULL)
+        return;
+
+    struct CIService *service;
+    const guint64 *slots;
+    GArray *userids = g_array_new(FALSE, FALSE, sizeof(gint));
+    guint i, j;
+
+    ci_service_update_index();
+    slots = ci_filter_index_match(ci_services_index, server, callinfo);
+
+    /* one lookup per user */
+    for (i = 0; i < ci_services_slots->len; ++i) {
+        if (!(slots[i / 64] & (G_GUINT64_CONSTANT(1) << (i % 64))))
+            continue;
+        service = (struct CIService *)g_ptr_array_index(ci_services_slots, i);
+        if (!service->active || service->userid == -1)
+            continue;
+        for (j = 0; j < userids->len; ++j) {
+            if (g_array_index(userids, gint, j) == service->userid)
+                break;
+        }
+        if (j < userids->len)
+            continue;
+        g_array_append_val(userids, service->userid);
+        prefetch_cb(callinfo->completenumber, service->userid, userdata, NULL, NULL);
+    }
+
+    g_array_free(userids, TRUE);
+}
+
+void ci_service_job_free(struct CIServiceJob *job)
+{
+    if (job == NULL)
+        return;
+    if (job->timeout_source)
+        g_source_remove(job->timeout_source);
+    g_slist_free_full(job->spool, (GDestroyNotify)ci_spool_done);
+    g_free(job->argv);
+    g_free(job->env);
+    if (job->input)
+        g_string_free(job->input, TRUE);
+    ci_service_unref(job->service);
+    ci_service_slab_free(&ci_service_job_slab, job);
+}
+
+void ci_service_dump_stats(GString *out)
+{
+    GList *tmp;
+    for (tmp = ci_services; tmp != NULL; tmp = g_list_next(tmp))
+        ci_stats_dump(((struct CIService *)tmp->data)->stats,
+                ((struct CIService *)tmp->data)->identifier, out);
+}
+
+void ci_service_dump_state(GString *out)
+{
+    GList *tmp;
+    struct CIService *service;
+    for (tmp = ci_services; tmp != NULL; tmp = g_list_next(tmp)) {
+        service = (struct CIService *)tmp->data;
+        g_string_append_printf(out, "%s: %s running=%u pending=%u calls=%" G_GUINT64_FORMAT
+                " spawned=%" G_GUINT64_FORMAT " dropped=%" G_GUINT64_FORMAT
+                " rate-limited=%" G_GUINT64_FORMAT " suppressed=%u\n",
+                service->identifier ? service->identifier : "<cmdline>",
+                service->active ? "active" : "sleeping",
+                service->running.length, service->pending.length,
+                ci_stats_get_count(service->stats, CIStatsCalls),
+                ci_stats_get_count(service->stats, CIStatsSpawned),
+                ci_stats_get_count(service->stats, CIStatsDropped),
+                ci_stats_get_count(service->stats, CIStatsRateLimited),
+                service->suppressed);
+    }
+}
+
+void ci_service_free(struct CIService *service)
+{
+    if (service != NULL) {
+        ci_services_retired = g_list_remove(ci_services_retired, service);
+        ci_filter_free(service->filter);
+        ci_service_template_free(service->template);
+        ci_service_unwatch_path(service);
+        g_free(service->program);
+        g_free(service->path);
+        ci_service_plugin_free(service->plugin);
+        ci_service_logfile_free(service->logfile);
+        g_free(service->signature);
+        g_free(service->command);
+        g_free(service->identifier);
+        /* after the log file, its last flush is counted */
+        ci_stats_unref(service->stats);
+        g_free(service);
+    }
+}
+
+struct CIService *ci_service_ref(struct CIService *service)
+{
+    if (service != NULL)
+        ++service->refcount;
+    return service;
+}
+
+void ci_service_unref(struct CIService *service)
+{
+    if (service != NULL && --service->refcount == 0)
+        ci_service_free(service);
+}
+
+/* keep the calls of a job in the spool, they are run again on the next start */
+void ci_service_job_forget(struct CIServiceJob *job)
+{
+    g_slist_free(job->spool);
+    job->spool = NULL;
+    ci_service_job_free(job);
+}
+
+/* discard queued jobs and an open batch, forget running jobs; only on shutdown */
+void ci_service_release_jobs(struct CIService *service)
+{
+    ci_service_ref(service);
+    if (service->batch_count > 0) {
+        if (service->batch_source)
+            g_source_remove(service->batch_source);
+        service->batch_source = 0;
+        g_ptr_array_unref(service->batch_values);
+        service->batch_values = NULL;
+        g_slist_free(service->batch_spool);
+        service->batch_spool = NULL;
+        service->batch_count = 0;
+        ci_service_unref(service);
+    }
+    if (service->suppressed_call) {
+        g_source_remove(service->summary_source);
+        service->summary_source = 0;
+        ci_service_call_unref(service->suppressed_call);
+        service->suppressed_call = NULL;
+        service->suppressed = 0;
+        ci_service_unref(service);
+    }
+    g_queue_foreach(&service->work_ready, (GFunc)ci_service_work_forget, NULL);
+    g_queue_clear(&service->work_ready);
+    g_queue_foreach(&service->pending, (GFunc)ci_service_job_forget, NULL);
+    g_queue_clear(&service->pending);
+    g_queue_foreach(&service->running, (GFunc)ci_service_job_forget, NULL);
+    g_queue_clear(&service->running);
+    ci_service_unref(service);
+}
+
+/* drop a service from the configuration; it is freed once its jobs and queries are done */
+void ci_service_retire(struct CIService *service)
+{
+    service->active = FALSE;
+    /* no more calls will join an open batch or summary */
+    ci_service_summary_flush(service);
+    ci_service_batch_flush(service);
+    ci_services_retired = g_list_prepend(ci_services_retired, service);
+    ci_service_unref(service);
+}
+
+void ci_service_begin_reload(void)
+{
+    g_return_if_fail(!ci_services_reloading);
+
+    ci_services_previous = ci_services;
+    ci_services = NULL;
+    ci_services_reloading = TRUE;
+    ci_service_invalidate_index();
+}
+
+void ci_service_set_signature(CIService *service, const gchar *signature)
+{
+    g_return_if_fail(service != NULL);
+
+    g_free(service->signature);
+    service->signature = g_strdup(signature);
+}
+
+gboolean ci_service_keep(const gchar *identifier, const gchar *signature)
+{
+    if (!ci_services_reloading || identifier == NULL || signature == NULL)
+        return FALSE;
+
+    GList *result = g_list_find_custom(ci_services_previous, identifier,
+            (GCompareFunc)ci_service_compare_identifier);
+    if (result == NULL || g_strcmp0(((struct CIService *)result->data)->signature, signature) != 0)
+        return FALSE;
+
+    ci_services = g_list_append(ci_services, ci_service_ref((struct CIService *)result->data));
+    return TRUE;
+}
+
+void ci_service_abort_reload(void)
+{
+    g_return_if_fail(ci_services_reloading);
+
+    g_list_free_full(ci_services, (GDestroyNotify)ci_service_unref);
+    ci_services = ci_services_previous;
+    ci_services_previous = NULL;
+    ci_services_reloading = FALSE;
+    ci_service_invalidate_index();
+}
+
+void ci_service_commit_reload(const gchar * const *activate)
+{
+    g_return_if_fail(ci_services_reloading);
+
+    GList *tmp;
+    GList *result;
+    GList *services = NULL;
+    struct CIService *service;
+    struct CIService *replacement;
+    guint i;
+
+    for (tmp = ci_services_previous; tmp != NULL; tmp = g_list_next(tmp)) {
+        service = (struct CIService *)tmp->data;
+        /* services from the command line are not part of the file */
+        if (service->identifier == NULL) {
+            services = g_list_append(services, service);
+            continue;
+        }
+        result = g_list_find_custom(ci_services, service->identifier,
+                (GCompareFunc)ci_service_compare_identifier);
+        replacement = result ? (struct CIService *)result->data : NULL;
+        if (replacement == service) {
+            ci_service_unref(service);
+            continue;
+        }
+        if (replacement != NULL) {
+            replacement->active = service->active;
+            /* the counters go on; jobs still running on the old one count there too */
+            ci_stats_unref(replacement->stats);
+            replacement->stats = ci_stats_ref(service->stats);
+            if (replacement->logfile)
+                replacement->logfile->stats = replacement->stats;
+            fprintf(stderr, "Service `%s' changed.\n", service->identifier);
+        }
+        else {
+            fprintf(stderr, "Service `%s' removed.\n", service->identifier);
+        }
+        ci_service_retire(service);
+    }
+
+    for (tmp = ci_services; tmp != NULL; tmp = g_list_next(tmp)) {
+        service = (struct CIService *)tmp->data;
+        if (!g_list_find_custom(ci_services_previous, service->identifier,
+                    (GCompareFunc)ci_service_compare_identifier)) {
+            for (i = 0; activate != NULL && activate[i] != NULL; ++i) {
+                if (g_strcmp0(activate[i], service->identifier) == 0)
+                    service->active = TRUE;
+            }
+            fprintf(stderr, "Service `%s' added.\n", service->identifier);
+        }
+    }
+
+    g_list_free(ci_services_previous);
+    ci_services_previous = NULL;
+    ci_services = g_list_concat(services, ci_services);
+    ci_services_reloading = FALSE;
+    ci_service_invalidate_index();
+}
+
+void ci_service_cleanup(void)
+{
+    if (ci_services_reloading)
+        ci_service_abort_reload();
+
+    /* expanded jobs not yet run stay in the spool */
+    ci_service_work_drain(FALSE);
+    ci_services_monitoring = FALSE;
+
+    g_list_foreach(ci_services, (GFunc)ci_service_release_jobs, NULL);
+    g_list_free_full(ci_services, (GDestroyNotify)ci_service_unref);
+    ci_services = NULL;
+    ci_service_invalidate_index();
+
+    /* services still waiting for a query reply stay allocated */
+    GList *retired = g_list_copy(ci_services_retired);
+    g_list_foreach(retired, (GFunc)ci_service_release_jobs, NULL);
+    g_list_free(retired);
+
+    ci_service_slab_clear(&ci_service_call_slab);
+    ci_service_slab_clear(&ci_service_query_slab);
+    ci_service_slab_clear(&ci_service_work_slab);
+    ci_service_slab_clear(&ci_service_job_slab);
+}
+
+void ci_service_job_start(struct CIServiceJob *job);
+
+void ci_service_schedule(struct CIService *service)
+{
+    while (service->pending.length > 0 &&
+            (service->max_concurrent <= 0 || service->running.length < service->max_concurrent))
+        ci_service_job_start((struct CIServiceJob *)g_queue_pop_head(&service->pending));
+}
+
+void ci_service_job_started_cb(GPid pid, struct CIServiceJob *job)
+{
+    job->spawn_time = g_get_monotonic_time();
+    ci_stats_count(job->service->stats, CIStatsSpawned);
+    ci_stats_record(job->service->stats, CIStatsLatencySpawn, job->start_time, job->spawn_time);
+    ci_stats_record(job->service->stats, CIStatsLatencyDispatch, job->ring_time, job->spawn_time);
+}
+
+void ci_service_job_exit_cb(gint status, struct CIServiceJob *job)
+{
+    struct CIService *service = ci_service_ref(job->service);
+
+    if (status == -1) {
+        ci_stats_count(service->stats, CIStatsSpawnFailed);
+    }
+    else {
+        ci_stats_count(service->stats,
+                WIFEXITED(status) && WEXITSTATUS(status) == 0 ? CIStatsExitedOk : CIStatsExitedError);
+        ci_stats_record(service->stats, CIStatsLatencyRun, job->spawn_time, g_get_monotonic_time());
+    }
+
+    job->spawner_job = 0;
+    g_queue_remove(&service->running, job);
+    ci_service_job_free(job);
+
+    ci_service_schedule(service);
+    ci_service_unref(service);
+}
+
+gboolean ci_service_job_timeout_cb(struct CIServiceJob *job)
+{
+    /* ask politely first, then kill after a grace period */
+    if (!job->terminated) {
+        job->terminated = TRUE;
+        ci_stats_count(job->service->stats, CIStatsKilled);
+        fprintf(stderr, "Service `%s' timed out, terminating.\n",
+                job->service->identifier ? job->service->identifier : "<cmdline>");
+        ci_spawner_kill(job->spawner_job, SIGTERM);
+        job->timeout_source = g_timeout_add_seconds(CI_SERVICE_KILL_GRACE,
+                (GSourceFunc)ci_service_job_timeout_cb, job);
+    }
+    else {
+        job->timeout_source = 0;
+        ci_spawner_kill(job->spawner_job, SIGKILL);
+    }
+
+    return FALSE;
+}
+
+void ci_service_job_start(struct CIServiceJob *job)
+{
+    struct CIService *service = job->service;
+
+    job->start_time = g_get_monotonic_time();
+    ci_stats_record(service->stats, CIStatsLatencyQueue, job->queue_time, job->start_time);
+
+    /* exec the resolved path, argv[0] stays as written in the command line */
+    if (service->path != NULL) {
+        job->spawner_job = ci_spawner_spawn(service->path, job->argv, job->env,
+                job->input ? job->input->str : NULL, job->input ? job->input->len : 0,
+                (CISpawnerStartCallback)ci_service_job_started_cb,
+                (CISpawnerExitCallback)ci_service_job_exit_cb, job);
+    }
+    else {
+        job->spawner_job = 0;
+    }
+    if (job->spawner_job == 0) {
+        ci_stats_count(service->stats, CIStatsSpawnFailed);
+        ci_service_job_free(job);
+        return;
+    }
+
+    g_queue_push_tail(&service->running, job);
+    if (service->timeout > 0)
+        job->timeout_source = g_timeout_add_seconds(service->timeout,
+                (GSourceFunc)ci_service_job_timeout_cb, job);
+}
+
+/* strv may be NULL */
+gboolean ci_service_strv_equal(gchar **a, gchar **b)
+{
+    gint i;
+
+    if (a == NULL || b == NULL)
+        return a == b;
+
+    for (i = 0; a[i] != NULL && b[i] != NULL; ++i) {
+        if (strcmp(a[i], b[i]) != 0)
+            return FALSE;
+    }
+
+    return a[i] == NULL && b[i] == NULL;
+}
+
+/* same command line, environment and input, so running one of them is enough */
+gboolean ci_service_job_equal(struct CIServiceJob *a, struct CIServiceJob *b)
+{
+    if ((a->input == NULL) != (b->input == NULL) ||
+            (a->input && !g_string_equal(a->input, b->input)))
+        return FALSE;
+
+    return ci_service_strv_equal(a->argv, b->argv) && ci_service_strv_equal(a->env, b->env);
+}
+
+/* takes ownership of argv, env, input and spool */
+void ci_service_run(struct CIService *service, gchar **argv, gchar **env, GString *input, gint64 ring_time,
+                    GSList *spool)
+{
+    struct CIServiceJob *job = ci_service_slab_alloc(&ci_service_job_slab);
+    job->service = ci_service_ref(service);
+    job->argv = argv;
+    job->env = env;
+    job->ring_time = ring_time;
+    job->queue_time = g_get_monotonic_time();
+    job->input = input;
+    job->spool = spool;
+
+    if (service->max_concurrent <= 0 || service->running.length < service->max_concurrent) {
+        ci_service_job_start(job);
+        return;
+    }
+
+    if (service->queue_depth <= 0 || service->pending.length < service->queue_depth) {
+        g_queue_push_tail(&service->pending, job);
+        return;
+    }
+
+    /* queue is full */
+    GList *tmp;
+    CIServiceOverflowPolicy policy = service->overflow;
+
+    if (policy == CIServiceOverflowCoalesce) {
+        struct CIServiceJob *queued;
+        for (tmp = service->pending.head; tmp != NULL; tmp = g_list_next(tmp)) {
+            queued = (struct CIServiceJob *)tmp->data;
+            if (ci_service_job_equal(queued, job)) {
+                /* the queued job runs for this call as well, its spool entries are done with it */
+                ci_stats_count(service->stats, CIStatsCoalesced);
+                queued->spool = g_slist_concat(queued->spool, job->spool);
+                job->spool = NULL;
+                ci_service_job_free(job);
+                return;
+            }
+        }
+        /* nothing to merge with, keep the most recent call */
+        policy = CIServiceOverflowDropOldest;
+    }
+
+    ci_stats_count(service->stats, CIStatsDropped);
+    if (policy == CIServiceOverflowDropOldest) {
+        ci_service_job_free((struct CIServiceJob *)g_queue_pop_head(&service->pending));
+        g_queue_push_tail(&service->pending, job);
+    }
+    else {
+        ci_service_job_free(job);
+    }
 }
@@ -3,10 +3,29 @@
 
 #include <glib.h>
 #include <cinetmsgs.h>
+#include "ci-filter.h"
+#include "ci-spool.h"
 
 typedef struct CIService CIService;
 
+/* what to do with a new call if the queue of a service is full */
+typedef enum {
+    CIServiceOverflowDropOldest = 0,
+    CIServiceOverflowDropNewest,
+    CIServiceOverflowCoalesce  /* merge with an identical queued call, else drop the oldest */
+} CIServiceOverflowPolicy;
+
 CIService *ci_service_add_service(const gchar *identifier, const gchar *commandline, gboolean active);
+/* options: NULL-terminated key, value pairs passed to the plugin's init function */
+CIService *ci_service_add_plugin(const gchar *identifier, const gchar *filename,
+                                 const gchar * const *options, gboolean active);
+/* format: line template, NULL for the default */
+CIService *ci_service_add_logfile(const gchar *identifier, const gchar *filename,
+                                  const gchar *format, gboolean active);
+/* interval in seconds (0: write every call), size in bytes */
+void ci_service_set_logfile_flush(CIService *service, guint interval, gsize size);
+/* size in bytes (0: never rotate), count: number of old files kept */
+void ci_service_set_logfile_rotation(CIService *service, gsize size, guint count);
 
 CIService *ci_service_get(const gchar *identifier);
 const gchar *ci_service_get_identifier(CIService *service);
@@ -19,12 +38,91 @@ gboolean ci_service_get_active(CIService *service);
 void ci_service_set_userid(CIService *service, gint userid);
 gint ci_service_get_userid(CIService *service);
 
+/* restrict the calls the service runs for, see ci-filter.h */
+void ci_service_add_filter(CIService *service, CIFilterField field, const gchar *value, gboolean exclude);
+
+/* max_concurrent, queue_depth <= 0: unlimited; timeout in seconds, <= 0: none */
+void ci_service_set_max_concurrent(CIService *service, gint max_concurrent);
+void ci_service_set_queue_depth(CIService *service, gint queue_depth);
+void ci_service_set_timeout(CIService *service, gint timeout);
+/* milliseconds to wait for the caller's name before running with the name of the call info; <= 0: wait */
+void ci_service_set_query_timeout(CIService *service, gint timeout);
+void ci_service_set_overflow_policy(CIService *service, CIServiceOverflowPolicy policy);
+gboolean ci_service_overflow_policy_from_string(const gchar *str, CIServiceOverflowPolicy *policy);
+
+/* what to do with calls beyond the rate of a service; they are not looked up with the
+ * caller query, a summary has the name of the call info */
+typedef enum {
+    CIServiceRateLimitDrop = 0,
+    CIServiceRateLimitSummary  /* run once per interval for the last of them, ${suppressed} set */
+} CIServiceRateLimitPolicy;
+
+/* rate in calls per minute, <= 0: unlimited; burst: calls allowed at once;
+ * interval: seconds between summaries, <= 0 for the default */
+void ci_service_set_rate_limit(CIService *service, gdouble rate, gint burst,
+                               CIServiceRateLimitPolicy policy, gint interval);
+gboolean ci_service_rate_limit_policy_from_string(const gchar *str, CIServiceRateLimitPolicy *policy);
+
+/* how call data is handed to a command in addition to the placeholders in its command line */
+typedef enum {
+    CIServiceInputArgv = 0,
+    CIServiceInputEnv,           /* CI_NUMBER, CI_NAME, … in the environment */
+    CIServiceInputStdinJson,     /* one JSON object per call on stdin */
+    CIServiceInputStdinKeyValue  /* key=value lines per call on stdin */
+} CIServiceInputMode;
+
+void ci_service_set_input_mode(CIService *service, CIServiceInputMode mode);
+gboolean ci_service_input_mode_from_string(const gchar *str, CIServiceInputMode *mode);
+
+/* collect calls for window seconds or until max calls and run the command once, with one
+ * record per call on stdin (tab-separated unless the input mode is a stdin format);
+ * window <= 0 and max <= 1 disables batching, window <= 0 alone flushes after 10 seconds */
+void ci_service_set_batch(CIService *service, gint window, gint max);
+
+/* expand command lines in up to threads threads instead of the main loop; jobs are
+ * still admitted and spawned from the main loop. threads <= 0: expand on the main loop */
+void ci_service_set_dispatch_threads(gint threads);
+
+/* watch the programs of command services and look them up again when they change;
+ * starts a GLib thread, so only call it after forking */
+void ci_service_start_monitors(void);
+
 /* name, data */
 typedef void (*CIServiceQueryCompleteCallback)(const gchar *, gpointer);
 /* completenumber, userid, userdata, cb, servicedata */
 typedef void (*CIServiceQueryCallerCallback)(const gchar *, gint, gpointer,
                                 CIServiceQueryCompleteCallback, gpointer);
-void ci_service_run_commands(CICallInfo *callinfo, CIServiceQueryCallerCallback query_caller_cb, gpointer userdata);
+/* completenumber, userid, userdata, servicedata: the query will not be waited for any more,
+ * cb must not be called for servicedata */
+typedef void (*CIServiceQueryCancelCallback)(const gchar *, gint, gpointer, gpointer);
+/* called when a query times out; without it, timed out queries are kept until the reply */
+void ci_service_set_query_cancel(CIServiceQueryCancelCallback cancel_cb);
+
+/* server: name of the server the call came from; userdata is passed to query_caller_cb */
+void ci_service_run_commands(const gchar *server, CICallInfo *callinfo,
+                             CIServiceQueryCallerCallback query_caller_cb, gpointer userdata);
+/* run a call left unfinished by the previous run for the service identifier again,
+ * see ci_spool_replay; entry is marked done if the service is gone or inactive */
+void ci_service_replay(CISpoolEntry *entry, const gchar *server, const gchar *identifier, GHashTable *values,
+                       CIServiceQueryCallerCallback query_caller_cb, gpointer userdata);
+/* start the caller lookups the services will need for callinfo, without running them */
+void ci_service_prefetch(const gchar *server, CICallInfo *callinfo,
+                         CIServiceQueryCallerCallback prefetch_cb, gpointer userdata);
+
+/* services added between begin and commit replace the running set; services kept by
+ * ci_service_keep, and replaced or removed ones finish their jobs and queries first */
+void ci_service_begin_reload(void);
+/* keep the running service if it was created from the same configuration */
+gboolean ci_service_keep(const gchar *identifier, const gchar *signature);
+void ci_service_set_signature(CIService *service, const gchar *signature);
+/* activate: identifiers of services to activate if they are new */
+void ci_service_commit_reload(const gchar * const *activate);
+void ci_service_abort_reload(void);
+
+/* counters and latency histograms of all services */
+void ci_service_dump_stats(GString *out);
+/* one line per service with its state, queue lengths and main counters */
+void ci_service_dump_state(GString *out);
 
 GList *ci_service_list_services(void); /* [element-type: CIService *][transfer-container] */
 
@@ -0,0 +1,823 @@
+#include "ci-spawner.h"
+#include <glib-unix.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <spawn.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+/* Requests from the daemon to the helper:
+ *   guint32 length of the following payload
+ *   guint32 request type
+ *   guint32 job id
+ *   spawn: guint32 argc, argc NUL-terminated strings,
+ *          guint32 envc, envc NUL-terminated NAME=value strings,
+ *          guint32 input length, input
+ *   kill:  guint32 signal
+ * Replies from the helper are fixed-size struct CISpawnerReply records.
+ */
+enum {
+    CISpawnerRequestSpawn = 1,
+    CISpawnerRequestKill
+};
+
+enum {
+    CISpawnerReplyStarted = 1,  /* value: pid */
+    CISpawnerReplyExited,       /* value: wait status */
+    CISpawnerReplyFailed        /* value: errno */
+};
+
+struct CISpawnerReply {
+    guint32 type;
+    guint32 job;
+    gint32 value;
+};
+
+struct CISpawnerJob {
+    guint id;
+    GPid pid;
+    guint child_watch;
+    CISpawnerStartCallback start_cb;
+    CISpawnerExitCallback exit_cb;
+    gpointer userdata;
+};
+
+struct {
+    pid_t pid;
+    gint fd;
+    GByteArray *outbuf;
+    GByteArray *inbuf;
+    guint out_source;
+    guint in_source;
+    guint next_job;
+    GHashTable *jobs; /* job id -> struct CISpawnerJob * */
+} ci_spawner = { -1, -1, NULL, NULL, 0, 0, 1, NULL };
+
+/* helper state, only used in the forked process */
+struct CISpawnerHelperChild {
+    guint32 job;
+    pid_t pid;
+};
+
+struct {
+    gint fd;
+    gint sigpipe[2];
+    struct CISpawnerHelperChild *children;
+    gsize n_children;
+    gsize size_children;
+} ci_spawner_helper;
+
+gboolean ci_spawner_read_full(gint fd, gpointer buffer, gsize length)
+{
+    gsize done = 0;
+    gssize rc;
+
+    while (done < length) {
+        rc = read(fd, (gchar *)buffer + done, length - done);
+        if (rc < 0 && errno == EINTR)
+            continue;
+        if (rc <= 0)
+            return FALSE;
+        done += rc;
+    }
+
+    return TRUE;
+}
+
+gboolean ci_spawner_write_full(gint fd, gconstpointer buffer, gsize length)
+{
+    gsize done = 0;
+    gssize rc;
+
+    while (done < length) {
+        rc = send(fd, (const gchar *)buffer + done, length - done, MSG_NOSIGNAL);
+        if (rc < 0 && errno == EINTR)
+            continue;
+        if (rc <= 0)
+            return FALSE;
+        done += rc;
+    }
+
+    return TRUE;
+}
+
+void ci_spawner_helper_reply(guint32 type, guint32 job, gint32 value)
+{
+    struct CISpawnerReply reply = { type, job, value };
+
+    if (!ci_spawner_write_full(ci_spawner_helper.fd, &reply, sizeof(struct CISpawnerReply)))
+        _exit(0);
+}
+
+void ci_spawner_helper_add_child(guint32 job, pid_t pid)
+{
+    if (ci_spawner_helper.n_children == ci_spawner_helper.size_children) {
+        gsize size = ci_spawner_helper.size_children ? 2 * ci_spawner_helper.size_children : 16;
+        struct CISpawnerHelperChild *children = realloc(ci_spawner_helper.children,
+                size * sizeof(struct CISpawnerHelperChild));
+        if (children == NULL)
+            return;
+        ci_spawner_helper.children = children;
+        ci_spawner_helper.size_children = size;
+    }
+    ci_spawner_helper.children[ci_spawner_helper.n_children].job = job;
+    ci_spawner_helper.children[ci_spawner_helper.n_children].pid = pid;
+    ++ci_spawner_helper.n_children;
+}
+
+void ci_spawner_helper_launch(guint32 job, gchar *payload, guint32 length)
+{
+    guint32 argc;
+    guint32 i;
+    gchar *pos;
+    gchar *end = payload + length;
+
+    /* file to execute, empty to look argv[0] up in PATH */
+    gchar *file = payload;
+    pos = payload + strnlen(payload, length) + 1;
+    if (pos + sizeof(guint32) > end)
+        goto invalid;
+    memcpy(&argc, pos, sizeof(guint32));
+    if (argc == 0 || argc > length)
+        goto invalid;
+
+    char **argv = calloc(argc + 1, sizeof(char *));
+    if (argv == NULL) {
+        ci_spawner_helper_reply(CISpawnerReplyFailed, job, ENOMEM);
+        return;
+    }
+
+    pos += sizeof(guint32);
+    for (i = 0; i < argc; ++i) {
+        if (pos >= end) {
+            free(argv);
+            goto invalid;
+        }
+        argv[i] = pos;
+        pos += strnlen(pos, end - pos) + 1;
+    }
+
+    /* extra variables replace those of the same name in the helper's environment */
+    guint32 envc = 0;
+    char **envp = environ;
+    if (pos + sizeof(guint32) <= end) {
+        memcpy(&envc, pos, sizeof(guint32));
+        pos += sizeof(guint32);
+    }
+    if (envc > (guint32)(end - pos)) {
+        free(argv);
+        goto invalid;
+    }
+    if (envc > 0) {
+        gsize n_environ = 0;
+        gsize n = 0;
+        gsize j;
+        gchar *eq;
+
+        while (environ[n_environ] != NULL)
+            ++n_environ;
+        envp = calloc(n_environ + envc + 1, sizeof(char *));
+        if (envp == NULL) {
+            free(argv);
+            ci_spawner_helper_reply(CISpawnerReplyFailed, job, ENOMEM);
+            return;
+        }
+        /* each entry NUL-terminated within the payload and of the form NAME=value */
+        for (i = 0; i < envc; ++i) {
+            gsize len = pos < end ? strnlen(pos, end - pos) : 0;
+            if (pos >= end || len == (gsize)(end - pos) ||
+                    (eq = memchr(pos, '=', len)) == NULL || eq == pos) {
+                free(envp);
+                free(argv);
+                goto invalid;
+            }
+            envp[n++] = pos;
+            pos += len + 1;
+        }
+        for (j = 0; j < n_environ; ++j) {
+            eq = strchr(environ[j], '=');
+            for (i = 0; eq != NULL && i < envc; ++i) {
+                if (strncmp(envp[i], environ[j], eq - environ[j] + 1) == 0)
+                    break;
+            }
+            if (eq == NULL || i == envc)
+                envp[n++] = environ[j];
+        }
+    }
+
+    guint32 input_length = 0;
+    if (pos + sizeof(guint32) <= end) {
+        memcpy(&input_length, pos, sizeof(guint32));
+        pos += sizeof(guint32);
+    }
+    if (input_length > (guint32)(end - pos)) {
+        if (envp != environ)
+            free(envp);
+        free(argv);
+        goto invalid;
+    }
+
+    /* stdin is fed from an unlinked temporary file so the helper never blocks on a pipe */
+    posix_spawn_file_actions_t actions;
+    gint input_fd = -1;
+    posix_spawn_file_actions_init(&actions);
+    if (input_length > 0) {
+        FILE *input = tmpfile();
+        if (input == NULL || fwrite(pos, 1, input_length, input) != input_length ||
+                fflush(input) != 0) {
+            if (input)
+                fclose(input);
+            posix_spawn_file_actions_destroy(&actions);
+            if (envp != environ)
+                free(envp);
+            free(argv);
+            ci_spawner_helper_reply(CISpawnerReplyFailed, job, EIO);
+            return;
+        }
+        input_fd = dup(fileno(input));
+        fclose(input);
+        lseek(input_fd, 0, SEEK_SET);
+        posix_spawn_file_actions_adddup2(&actions, input_fd, 0);
+    }
+
+    /* children get default signal handling, independent of the helper */
+    posix_spawnattr_t attr;
+    sigset_t sigdefault, sigmask;
+    pid_t pid;
+    gint rc;
+
+    sigemptyset(&sigmask);
+    sigemptyset(&sigdefault);
+    sigaddset(&sigdefault, SIGCHLD);
+    sigaddset(&sigdefault, SIGINT);
+    sigaddset(&sigdefault, SIGHUP);
+    sigaddset(&sigdefault, SIGPIPE);
+
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigmask(&attr, &sigmask);
+    posix_spawnattr_setsigdefault(&attr, &sigdefault);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+    if (file[0] != 0)
+        rc = posix_spawn(&pid, file, &actions, &attr, argv, envp);
+    else
+        rc = posix_spawnp(&pid, argv[0], &actions, &attr, argv, envp);
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    if (envp != environ)
+        free(envp);
+    if (input_fd != -1)
+        close(input_fd);
+    free(argv);
+
+    if (rc != 0) {
+        ci_spawner_helper_reply(CISpawnerReplyFailed, job, rc);
+        return;
+    }
+
+    ci_spawner_helper_add_child(job, pid);
+    ci_spawner_helper_reply(CISpawnerReplyStarted, job, pid);
+    return;
+
+invalid:
+    ci_spawner_helper_reply(CISpawnerReplyFailed, job, EINVAL);
+}
+
+void ci_spawner_helper_kill(guint32 job, gchar *payload, guint32 length)
+{
+    gint32 signum;
+    gsize i;
+
+    if (length < sizeof(gint32))
+        return;
+    memcpy(&signum, payload, sizeof(gint32));
+
+    for (i = 0; i < ci_spawner_helper.n_children; ++i) {
+        if (ci_spawner_helper.children[i].job == job) {
+            kill(ci_spawner_helper.children[i].pid, signum);
+            return;
+        }
+    }
+}
+
+void ci_spawner_helper_reap(void)
+{
+    pid_t pid;
+    gint status;
+    gsize i;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (i = 0; i < ci_spawner_helper.n_children; ++i) {
+            if (ci_spawner_helper.children[i].pid == pid) {
+                ci_spawner_helper_reply(CISpawnerReplyExited, ci_spawner_helper.children[i].job, status);
+                ci_spawner_helper.children[i] = ci_spawner_helper.children[--ci_spawner_helper.n_children];
+                break;
+            }
+        }
+    }
+}
+
+gboolean ci_spawner_helper_handle_request(void)
+{
+    guint32 header[3];
+    gchar *payload;
+
+    if (!ci_spawner_read_full(ci_spawner_helper.fd, header, sizeof(header)))
+        return FALSE;
+    if (header[0] < 2 * sizeof(guint32))
+        return FALSE;
+    header[0] -= 2 * sizeof(guint32);
+
+    if ((payload = malloc(header[0] + 1)) == NULL)
+        return FALSE;
+    if (!ci_spawner_read_full(ci_spawner_helper.fd, payload, header[0])) {
+        free(payload);
+        return FALSE;
+    }
+    payload[header[0]] = 0;
+
+    if (header[1] == CISpawnerRequestSpawn)
+        ci_spawner_helper_launch(header[2], payload, header[0]);
+    else if (header[1] == CISpawnerRequestKill)
+        ci_spawner_helper_kill(header[2], payload, header[0]);
+
+    free(payload);
+    return TRUE;
+}
+
+void ci_spawner_helper_sigchld(int signum)
+{
+    gint saved_errno = errno;
+    if (write(ci_spawner_helper.sigpipe[1], "c", 1) < 0) {
+        /* pipe is full, a wakeup is pending anyway */
+    }
+    errno = saved_errno;
+}
+
+/* runs in the forked helper; only plain libc from here on */
+void ci_spawner_helper_main(gint fd)
+{
+    struct pollfd fds[2];
+    gchar drain[64];
+
+    memset(&ci_spawner_helper, 0, sizeof(ci_spawner_helper));
+    ci_spawner_helper.fd = fd;
+    if (pipe(ci_spawner_helper.sigpipe) != 0)
+        _exit(1);
+    fcntl(ci_spawner_helper.sigpipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(ci_spawner_helper.sigpipe[1], F_SETFD, FD_CLOEXEC);
+    fcntl(ci_spawner_helper.sigpipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(ci_spawner_helper.sigpipe[1], F_SETFL, O_NONBLOCK);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = ci_spawner_helper_sigchld;
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGCHLD, &sa, NULL);
+
+    signal(SIGINT, SIG_IGN);
+    signal(SIGHUP, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+
+    fds[0].fd = fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = ci_spawner_helper.sigpipe[0];
+    fds[1].events = POLLIN;
+
+    while (1) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (fds[1].revents & POLLIN) {
+            while (read(ci_spawner_helper.sigpipe[0], drain, sizeof(drain)) > 0);
+            ci_spawner_helper_reap();
+        }
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            if (!ci_spawner_helper_handle_request())
+                break;
+        }
+    }
+
+    _exit(0);
+}
+
+void ci_spawner_job_free(struct CISpawnerJob *job)
+{
+    if (job == NULL)
+        return;
+    if (job->child_watch)
+        g_source_remove(job->child_watch);
+    g_free(job);
+}
+
+void ci_spawner_job_finish(guint id, gint status)
+{
+    struct CISpawnerJob *job = g_hash_table_lookup(ci_spawner.jobs, GUINT_TO_POINTER(id));
+    if (job == NULL)
+        return;
+
+    g_hash_table_steal(ci_spawner.jobs, GUINT_TO_POINTER(id));
+    if (job->exit_cb)
+        job->exit_cb(status, job->userdata);
+    ci_spawner_job_free(job);
+}
+
+void ci_spawner_lost(void);
+
+void ci_spawner_handle_reply(struct CISpawnerReply *reply)
+{
+    struct CISpawnerJob *job;
+
+    switch (reply->type) {
+        case CISpawnerReplyStarted:
+            job = g_hash_table_lookup(ci_spawner.jobs, GUINT_TO_POINTER(reply->job));
+            if (job) {
+                job->pid = reply->value;
+                if (job->start_cb)
+                    job->start_cb(job->pid, job->userdata);
+            }
+            break;
+        case CISpawnerReplyExited:
+            ci_spawner_job_finish(reply->job, reply->value);
+            break;
+        case CISpawnerReplyFailed:
+            ci_spawner_job_finish(reply->job, -1);
+            break;
+    }
+}
+
+gboolean ci_spawner_readable_cb(gint fd, GIOCondition condition, gpointer userdata)
+{
+    guint8 buffer[4096];
+    gssize rc;
+    gsize offset;
+
+    while ((rc = read(fd, buffer, sizeof(buffer))) > 0)
+        g_byte_array_append(ci_spawner.inbuf, buffer, rc);
+    gboolean eof = (rc == 0 || (rc < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR));
+
+    /* exit callbacks may spawn again and lose the helper, so work on our own copy */
+    GByteArray *records = ci_spawner.inbuf;
+    ci_spawner.inbuf = g_byte_array_new();
+
+    for (offset = 0; offset + sizeof(struct CISpawnerReply) <= records->len;
+            offset += sizeof(struct CISpawnerReply)) {
+        struct CISpawnerReply reply;
+        memcpy(&reply, records->data + offset, sizeof(struct CISpawnerReply));
+        ci_spawner_handle_reply(&reply);
+    }
+    if (ci_spawner.inbuf != NULL)
+        g_byte_array_append(ci_spawner.inbuf, records->data + offset, records->len - offset);
+    g_byte_array_free(records, TRUE);
+
+    if (ci_spawner.fd == -1)
+        return FALSE;
+
+    if (eof) {
+        ci_spawner.in_source = 0;
+        ci_spawner_lost();
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+gboolean ci_spawner_start(void)
+{
+    gint fds[2];
+
+    if (ci_spawner.pid > 0)
+        return TRUE;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+        return FALSE;
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
+    fflush(stdout);
+    fflush(stderr);
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        close(fds[0]);
+        close(fds[1]);
+        return FALSE;
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        ci_spawner_helper_main(fds[1]);
+    }
+
+    close(fds[1]);
+    g_unix_set_fd_nonblocking(fds[0], TRUE, NULL);
+
+    ci_spawner.pid = pid;
+    ci_spawner.fd = fds[0];
+    ci_spawner.outbuf = g_byte_array_new();
+    ci_spawner.inbuf = g_byte_array_new();
+    ci_spawner.in_source = g_unix_fd_add(ci_spawner.fd, G_IO_IN | G_IO_HUP | G_IO_ERR,
+            (GUnixFDSourceFunc)ci_spawner_readable_cb, NULL);
+
+    return TRUE;
+}
+
+void ci_spawner_shutdown_helper(void)
+{
+    if (ci_spawner.out_source) {
+        g_source_remove(ci_spawner.out_source);
+        ci_spawner.out_source = 0;
+    }
+    if (ci_spawner.in_source) {
+        g_source_remove(ci_spawner.in_source);
+        ci_spawner.in_source = 0;
+    }
+    if (ci_spawner.fd != -1) {
+        close(ci_spawner.fd);
+        ci_spawner.fd = -1;
+    }
+    if (ci_spawner.pid > 0) {
+        /* the helper exits on EOF */
+        waitpid(ci_spawner.pid, NULL, 0);
+        ci_spawner.pid = -1;
+    }
+    if (ci_spawner.outbuf) {
+        g_byte_array_free(ci_spawner.outbuf, TRUE);
+        ci_spawner.outbuf = NULL;
+    }
+    if (ci_spawner.inbuf) {
+        g_byte_array_free(ci_spawner.inbuf, TRUE);
+        ci_spawner.inbuf = NULL;
+    }
+}
+
+void ci_spawner_stop(void)
+{
+    ci_spawner_shutdown_helper();
+    if (ci_spawner.jobs) {
+        g_hash_table_destroy(ci_spawner.jobs);
+        ci_spawner.jobs = NULL;
+    }
+}
+
+gboolean ci_spawner_is_running(void)
+{
+    return ci_spawner.fd != -1;
+}
+
+gboolean ci_spawner_finish_lost_jobs(gpointer userdata)
+{
+    GList *ids = g_hash_table_get_keys(ci_spawner.jobs);
+    GList *tmp;
+    struct CISpawnerJob *job;
+
+    for (tmp = ids; tmp != NULL; tmp = g_list_next(tmp)) {
+        job = g_hash_table_lookup(ci_spawner.jobs, tmp->data);
+        if (job && job->child_watch == 0)
+            ci_spawner_job_finish(GPOINTER_TO_UINT(tmp->data), -1);
+    }
+    g_list_free(ids);
+
+    return FALSE;
+}
+
+void ci_spawner_lost(void)
+{
+    fprintf(stderr, "Spawner helper is gone, spawning directly.\n");
+    ci_spawner_shutdown_helper();
+    /* children of the helper can no longer be tracked */
+    if (ci_spawner.jobs)
+        g_idle_add(ci_spawner_finish_lost_jobs, NULL);
+}
+
+/* write as much of the output buffer as the socket takes without blocking */
+gboolean ci_spawner_flush(void)
+{
+    gssize rc;
+
+    while (ci_spawner.outbuf->len > 0) {
+        rc = send(ci_spawner.fd, ci_spawner.outbuf->data, ci_spawner.outbuf->len, MSG_NOSIGNAL);
+        if (rc < 0 && errno == EINTR)
+            continue;
+        if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return TRUE;
+        if (rc <= 0)
+            return FALSE;
+        g_byte_array_remove_range(ci_spawner.outbuf, 0, rc);
+    }
+
+    return TRUE;
+}
+
+gboolean ci_spawner_writable_cb(gint fd, GIOCondition condition, gpointer userdata)
+{
+    if (!ci_spawner_flush()) {
+        ci_spawner.out_source = 0;
+        ci_spawner_lost();
+        return FALSE;
+    }
+    if (ci_spawner.outbuf->len == 0) {
+        ci_spawner.out_source = 0;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+gboolean ci_spawner_send(guint32 type, guint32 job, GByteArray *payload)
+{
+    guint32 header[3];
+
+    header[0] = 2 * sizeof(guint32) + payload->len;
+    header[1] = type;
+    header[2] = job;
+    g_byte_array_append(ci_spawner.outbuf, (guint8 *)header, sizeof(header));
+    g_byte_array_append(ci_spawner.outbuf, payload->data, payload->len);
+
+    if (ci_spawner.out_source)
+        return TRUE;
+
+    if (!ci_spawner_flush()) {
+        ci_spawner_lost();
+        return FALSE;
+    }
+    if (ci_spawner.outbuf->len > 0)
+        ci_spawner.out_source = g_unix_fd_add(ci_spawner.fd, G_IO_OUT,
+                (GUnixFDSourceFunc)ci_spawner_writable_cb, NULL);
+
+    return TRUE;
+}
+
+void ci_spawner_child_watch_cb(GPid pid, gint status, struct CISpawnerJob *job)
+{
+    g_spawn_close_pid(pid);
+    job->child_watch = 0;
+    ci_spawner_job_finish(job->id, status);
+}
+
+#if !GLIB_CHECK_VERSION(2,58,0)
+/* runs in the child after GLib set up stdin */
+void ci_spawner_child_setup_input(gpointer fd)
+{
+    if (dup2(GPOINTER_TO_INT(fd), 0) == -1)
+        _exit(127);
+}
+#endif
+
+gboolean ci_spawner_spawn_direct(struct CISpawnerJob *job, const gchar *file, gchar **argv,
+                                 gchar **env, const gchar *input, gsize input_length)
+{
+    GSpawnFlags flags = G_SPAWN_DO_NOT_REAP_CHILD;
+    gchar **envp = NULL;
+    gchar **file_argv = NULL;
+    gboolean spawned;
+    guint i;
+
+    /* file first, then argv including argv[0] */
+    if (file != NULL) {
+        guint argc = g_strv_length(argv);
+        file_argv = g_malloc(sizeof(gchar *) * (argc + 2));
+        file_argv[0] = (gchar *)file;
+        memcpy(file_argv + 1, argv, sizeof(gchar *) * (argc + 1));
+        argv = file_argv;
+        flags |= G_SPAWN_FILE_AND_ARGV_ZERO;
+    }
+    else {
+        flags |= G_SPAWN_SEARCH_PATH;
+    }
+
+    if (env != NULL) {
+        envp = g_get_environ();
+        for (i = 0; env[i] != NULL; ++i) {
+            gchar **pair = g_strsplit(env[i], "=", 2);
+            envp = g_environ_setenv(envp, pair[0], pair[1] ? pair[1] : "", TRUE);
+            g_strfreev(pair);
+        }
+    }
+
+    if (input_length == 0) {
+        spawned = g_spawn_async(NULL, argv, envp, flags, NULL, NULL, &job->pid, NULL);
+    }
+    else {
+        gint input_fd;
+        FILE *tmp = tmpfile();
+
+        if (tmp == NULL || fwrite(input, 1, input_length, tmp) != input_length || fflush(tmp) != 0) {
+            if (tmp)
+                fclose(tmp);
+            g_strfreev(envp);
+            g_free(file_argv);
+            return FALSE;
+        }
+        input_fd = fileno(tmp);
+        lseek(input_fd, 0, SEEK_SET);
+#if GLIB_CHECK_VERSION(2,58,0)
+        spawned = g_spawn_async_with_fds(NULL, argv, envp, flags, NULL, NULL, &job->pid,
+                input_fd, -1, -1, NULL);
+#else
+        /* the child reads the temporary file, like with the helper */
+        spawned = g_spawn_async(NULL, argv, envp, flags,
+                (GSpawnChildSetupFunc)ci_spawner_child_setup_input, GINT_TO_POINTER(input_fd),
+                &job->pid, NULL);
+#endif
+        fclose(tmp);
+    }
+    g_strfreev(envp);
+    g_free(file_argv);
+    if (!spawned)
+        return FALSE;
+
+    job->child_watch = g_child_watch_add(job->pid, (GChildWatchFunc)ci_spawner_child_watch_cb, job);
+    return TRUE;
+}
+
+guint ci_spawner_spawn(const gchar *file, gchar **argv, gchar **env, const gchar *input, gsize input_length,
+                       CISpawnerStartCallback start_cb, CISpawnerExitCallback exit_cb,
+                       gpointer userdata)
+{
+    if (argv == NULL || argv[0] == NULL)
+        return 0;
+
+    if (ci_spawner.jobs == NULL)
+        ci_spawner.jobs = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                NULL, (GDestroyNotify)ci_spawner_job_free);
+
+    struct CISpawnerJob *job = g_malloc0(sizeof(struct CISpawnerJob));
+    job->id = ci_spawner.next_job++;
+    if (ci_spawner.next_job == 0)
+        ci_spawner.next_job = 1;
+    job->start_cb = start_cb;
+    job->exit_cb = exit_cb;
+    job->userdata = userdata;
+
+    if (ci_spawner.fd != -1) {
+        GByteArray *payload = g_byte_array_new();
+        guint32 argc = g_strv_length(argv);
+        guint32 i;
+
+        g_byte_array_append(payload, (const guint8 *)(file ? file : ""), file ? strlen(file) + 1 : 1);
+        g_byte_array_append(payload, (guint8 *)&argc, sizeof(guint32));
+        for (i = 0; i < argc; ++i)
+            g_byte_array_append(payload, (guint8 *)argv[i], strlen(argv[i]) + 1);
+        guint32 envc = env ? g_strv_length(env) : 0;
+        g_byte_array_append(payload, (guint8 *)&envc, sizeof(guint32));
+        for (i = 0; i < envc; ++i)
+            g_byte_array_append(payload, (guint8 *)env[i], strlen(env[i]) + 1);
+        guint32 length = input ? input_length : 0;
+        g_byte_array_append(payload, (guint8 *)&length, sizeof(guint32));
+        if (length > 0)
+            g_byte_array_append(payload, (const guint8 *)input, length);
+
+        gboolean sent = ci_spawner_send(CISpawnerRequestSpawn, job->id, payload);
+        g_byte_array_free(payload, TRUE);
+
+        if (sent) {
+            g_hash_table_insert(ci_spawner.jobs, GUINT_TO_POINTER(job->id), job);
+            return job->id;
+        }
+    }
+
+    if (!ci_spawner_spawn_direct(job, file, argv, env, input, input ? input_length : 0)) {
+        ci_spawner_job_free(job);
+        return 0;
+    }
+
+    g_hash_table_insert(ci_spawner.jobs, GUINT_TO_POINTER(job->id), job);
+    if (job->start_cb)
+        job->start_cb(job->pid, job->userdata);
+    return job->id;
+}
+
+void ci_spawner_kill(guint id, gint signum)
+{
+    struct CISpawnerJob *job = NULL;
+
+    if (ci_spawner.jobs)
+        job = g_hash_table_lookup(ci_spawner.jobs, GUINT_TO_POINTER(id));
+    if (job == NULL)
+        return;
+
+    if (job->child_watch) {
+        kill(job->pid, signum);
+        return;
+    }
+
+    if (ci_spawner.fd != -1) {
+        GByteArray *payload = g_byte_array_new();
+        gint32 value = signum;
+        g_byte_array_append(payload, (guint8 *)&value, sizeof(gint32));
+        ci_spawner_send(CISpawnerRequestKill, id, payload);
+        g_byte_array_free(payload, TRUE);
+    }
+}
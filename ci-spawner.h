@@ -0,0 +1,28 @@
+#ifndef __CI_SPAWNER_H__
+#define __CI_SPAWNER_H__
+
+#include <glib.h>
+
+/* pid of the started command */
+typedef void (*CISpawnerStartCallback)(GPid, gpointer);
+/* wait status as from waitpid(), or -1 if the command could not be started */
+typedef void (*CISpawnerExitCallback)(gint, gpointer);
+
+/* fork the helper process; call once at startup before the main loop runs */
+gboolean ci_spawner_start(void);
+void ci_spawner_stop(void);
+
+gboolean ci_spawner_is_running(void);
+
+/* hand argv to the helper; falls back to g_spawn_async if the helper is not running.
+ * file (may be NULL) is the program executed, argv[0] is looked up in PATH without it,
+ * env (may be NULL) holds NAME=value pairs added to the environment,
+ * input (may be NULL) is fed to the command's stdin.
+ * Returns a job id (0 on failure). exit_cb is always called from the main loop,
+ * start_cb (may be NULL) may be called before this function returns. */
+guint ci_spawner_spawn(const gchar *file, gchar **argv, gchar **env, const gchar *input, gsize input_length,
+                       CISpawnerStartCallback start_cb, CISpawnerExitCallback exit_cb,
+                       gpointer userdata);
+void ci_spawner_kill(guint job, gint signum);
+
+#endif
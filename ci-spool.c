@@ -0,0 +1,455 @@
+#include "ci-spool.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <glib/gstdio.h>
+
+/* on disk, each record is a header followed by the payload, padded to 8 bytes:
+ *   magic, state, payload length, payload checksum    (guint32 each, host byte order)
+ *   payload: server\0service\0key\0value\0key\0value\0…
+ * the state is written last, so a record torn by a crash of the process ends the scan
+ * of its segment; after a power loss the pages of the mapping may have reached the disk
+ * in any order, so pending records are only replayed if the checksum matches */
+#define CI_SPOOL_MAGIC 0x32534943 /* "CIS2" */
+#define CI_SPOOL_HEADER_SIZE 16
+#define CI_SPOOL_ALIGN(n) (((n) + 7) & ~((gsize)7))
+
+/* seconds between compaction runs */
+#define CI_SPOOL_COMPACT_INTERVAL 60
+
+typedef enum {
+    CISpoolStateFree = 0,
+    CISpoolStatePending,
+    CISpoolStateDone
+} CISpoolState;
+
+struct CISpoolSegment {
+    guint index;
+    gchar *filename;
+    gint fd;
+    guint8 *map;
+    gsize size;
+    gsize used;
+    gboolean dirty;
+    GQueue entries; /* [element-type: CISpoolEntry *] pending records */
+};
+
+struct CISpoolEntry {
+    struct CISpoolSegment *segment;
+    gsize offset;
+    GList link;
+};
+
+struct {
+    gchar *path;
+    gsize segment_size;
+    GList *segments; /* [element-type: struct CISpoolSegment *] oldest first, last is written to */
+    guint sync_source;
+    guint compact_source;
+    GThreadPool *syncer;
+    GList *replay;   /* [element-type: CISpoolEntry *] from the previous run */
+} ci_spool;
+
+struct CISpoolSegment *ci_spool_segment_current(void)
+{
+    GList *last = g_list_last(ci_spool.segments);
+    return last ? (struct CISpoolSegment *)last->data : NULL;
+}
+
+void ci_spool_segment_free(struct CISpoolSegment *segment, gboolean remove)
+{
+    if (segment == NULL)
+        return;
+
+    while (segment->entries.length > 0)
+        g_free(g_queue_pop_head_link(&segment->entries)->data);
+    if (segment->map != NULL)
+        munmap(segment->map, segment->size);
+    if (segment->fd >= 0) {
+        if (segment->dirty && !remove)
+            fdatasync(segment->fd);
+        close(segment->fd);
+    }
+    if (remove)
+        g_unlink(segment->filename);
+    g_free(segment->filename);
+    g_free(segment);
+}
+
+struct CISpoolSegment *ci_spool_segment_open(guint index, gboolean create)
+{
+    struct CISpoolSegment *segment = g_malloc0(sizeof(struct CISpoolSegment));
+    struct stat st;
+
+    segment->index = index;
+    segment->filename = g_strdup_printf("%s.%u", ci_spool.path, index);
+    segment->fd = open(segment->filename, O_RDWR | (create ? O_CREAT | O_TRUNC : 0), 0600);
+    g_queue_init(&segment->entries);
+
+    if (segment->fd == -1 || fstat(segment->fd, &st) == -1)
+        goto fail;
+
+    segment->size = create ? ci_spool.segment_size : (gsize)st.st_size;
+    if (create && ftruncate(segment->fd, segment->size) == -1)
+        goto fail;
+    if (segment->size < CI_SPOOL_HEADER_SIZE)
+        goto fail;
+
+    segment->map = mmap(NULL, segment->size, PROT_READ | PROT_WRITE, MAP_SHARED, segment->fd, 0);
+    if (segment->map == MAP_FAILED) {
+        segment->map = NULL;
+        goto fail;
+    }
+
+    return segment;
+
+fail:
+    fprintf(stderr, "Could not open spool segment `%s': %s\n", segment->filename, g_strerror(errno));
+    ci_spool_segment_free(segment, FALSE);
+    return NULL;
+}
+
+guint32 *ci_spool_record_header(struct CISpoolSegment *segment, gsize offset)
+{
+    return (guint32 *)(segment->map + offset);
+}
+
+/* FNV-1a */
+guint32 ci_spool_checksum(const guint8 *data, gsize length)
+{
+    guint32 hash = 2166136261u;
+    gsize i;
+
+    for (i = 0; i < length; ++i) {
+        hash ^= data[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+CISpoolEntry *ci_spool_entry_new(struct CISpoolSegment *segment, gsize offset)
+{
+    CISpoolEntry *entry = g_malloc0(sizeof(struct CISpoolEntry));
+    entry->segment = segment;
+    entry->offset = offset;
+    entry->link.data = entry;
+    g_queue_push_tail_link(&segment->entries, &entry->link);
+    return entry;
+}
+
+/* drop segments without pending records, except the one written to */
+void ci_spool_release_segments(void)
+{
+    GList *tmp = ci_spool.segments;
+    GList *next;
+    struct CISpoolSegment *segment;
+
+    while (tmp != NULL && tmp->next != NULL) {
+        next = tmp->next;
+        segment = (struct CISpoolSegment *)tmp->data;
+        if (segment->entries.length == 0) {
+            ci_spool_segment_free(segment, TRUE);
+            ci_spool.segments = g_list_delete_link(ci_spool.segments, tmp);
+        }
+        tmp = next;
+    }
+}
+
+/* copy a record into the current segment; returns the offset or -1 */
+gssize ci_spool_write(const guint8 *payload, gsize length)
+{
+    struct CISpoolSegment *segment = ci_spool_segment_current();
+    gsize needed = CI_SPOOL_HEADER_SIZE + CI_SPOOL_ALIGN(length);
+    guint32 *header;
+    gsize offset;
+
+    if (needed > ci_spool.segment_size)
+        return -1;
+
+    if (segment == NULL || segment->used + needed > segment->size) {
+        segment = ci_spool_segment_open(segment ? segment->index + 1 : 0, TRUE);
+        if (segment == NULL)
+            return -1;
+        ci_spool.segments = g_list_append(ci_spool.segments, segment);
+        ci_spool_release_segments();
+    }
+
+    offset = segment->used;
+    header = ci_spool_record_header(segment, offset);
+    memcpy(segment->map + offset + CI_SPOOL_HEADER_SIZE, payload, length);
+    header[0] = CI_SPOOL_MAGIC;
+    header[2] = (guint32)length;
+    header[3] = ci_spool_checksum(payload, length);
+    header[1] = CISpoolStatePending;
+    segment->used += needed;
+    segment->dirty = TRUE;
+
+    return (gssize)offset;
+}
+
+CISpoolEntry *ci_spool_append(const gchar *server, const gchar *service,
+                              const gchar * const *keys, const gchar * const *values, guint n_values)
+{
+    if (ci_spool.path == NULL || service == NULL)
+        return NULL;
+
+    GByteArray *payload = g_byte_array_sized_new(512);
+    gssize offset;
+    guint i;
+
+    g_byte_array_append(payload, (const guint8 *)(server ? server : ""), strlen(server ? server : "") + 1);
+    g_byte_array_append(payload, (const guint8 *)service, strlen(service) + 1);
+    for (i = 0; i < n_values; ++i) {
+        if (values[i] == NULL)
+            continue;
+        g_byte_array_append(payload, (const guint8 *)keys[i], strlen(keys[i]) + 1);
+        g_byte_array_append(payload, (const guint8 *)values[i], strlen(values[i]) + 1);
+    }
+
+    offset = ci_spool_write(payload->data, payload->len);
+    g_byte_array_free(payload, TRUE);
+
+    if (offset < 0)
+        return NULL;
+
+    return ci_spool_entry_new(ci_spool_segment_current(), offset);
+}
+
+void ci_spool_done(CISpoolEntry *entry)
+{
+    if (entry == NULL)
+        return;
+
+    struct CISpoolSegment *segment = entry->segment;
+
+    ci_spool_record_header(segment, entry->offset)[1] = CISpoolStateDone;
+    segment->dirty = TRUE;
+    g_queue_unlink(&segment->entries, &entry->link);
+    g_free(entry);
+
+    if (segment->entries.length == 0 && segment != ci_spool_segment_current())
+        ci_spool_release_segments();
+}
+
+/* move pending records out of old segments so these can be removed;
+ * stops when the current segment fills up, the rest is moved next time */
+gboolean ci_spool_compact_cb(gpointer userdata)
+{
+    struct CISpoolSegment *current = ci_spool_segment_current();
+    struct CISpoolSegment *segment;
+    GList *tmp;
+    CISpoolEntry *entry;
+    guint32 *header;
+    gssize offset;
+
+    for (tmp = ci_spool.segments; tmp != NULL && tmp->data != current; tmp = tmp->next) {
+        segment = (struct CISpoolSegment *)tmp->data;
+        while (segment->entries.head != NULL) {
+            entry = (CISpoolEntry *)segment->entries.head->data;
+            header = ci_spool_record_header(segment, entry->offset);
+            offset = ci_spool_write((guint8 *)header + CI_SPOOL_HEADER_SIZE, header[2]);
+            if (offset < 0)
+                return TRUE;
+            header[1] = CISpoolStateDone;
+            segment->dirty = TRUE;
+            /* the entry keeps its identity for whoever holds it */
+            g_queue_unlink(&segment->entries, &entry->link);
+            entry->segment = ci_spool_segment_current();
+            entry->offset = offset;
+            g_queue_push_tail_link(&entry->segment->entries, &entry->link);
+            if (entry->segment != current)
+                goto out;
+        }
+    }
+
+out:
+    ci_spool_release_segments();
+    return TRUE;
+}
+
+void ci_spool_sync_func(gpointer data, gpointer userdata)
+{
+    gint fd = GPOINTER_TO_INT(data) - 1;
+
+    fdatasync(fd);
+    close(fd);
+}
+
+/* hand the disk syncs to a thread, the main loop does not wait for them */
+gboolean ci_spool_sync_cb(gpointer userdata)
+{
+    GList *tmp;
+    struct CISpoolSegment *segment;
+    gint fd;
+
+    for (tmp = ci_spool.segments; tmp != NULL; tmp = g_list_next(tmp)) {
+        segment = (struct CISpoolSegment *)tmp->data;
+        if (!segment->dirty)
+            continue;
+        segment->dirty = FALSE;
+        if ((fd = dup(segment->fd)) == -1)
+            continue;
+        g_thread_pool_push(ci_spool.syncer, GINT_TO_POINTER(fd + 1), NULL);
+    }
+
+    return TRUE;
+}
+
+/* collect the pending records of an existing segment */
+void ci_spool_segment_scan(struct CISpoolSegment *segment)
+{
+    gsize offset = 0;
+    guint32 *header;
+
+    while (offset + CI_SPOOL_HEADER_SIZE <= segment->size) {
+        header = ci_spool_record_header(segment, offset);
+        if (header[0] != CI_SPOOL_MAGIC || header[1] == CISpoolStateFree ||
+                offset + CI_SPOOL_HEADER_SIZE + CI_SPOOL_ALIGN(header[2]) > segment->size)
+            break;
+        if (header[1] == CISpoolStatePending &&
+                header[3] == ci_spool_checksum((guint8 *)header + CI_SPOOL_HEADER_SIZE, header[2]))
+            ci_spool.replay = g_list_append(ci_spool.replay, ci_spool_entry_new(segment, offset));
+        offset += CI_SPOOL_HEADER_SIZE + CI_SPOOL_ALIGN(header[2]);
+    }
+
+    segment->used = offset;
+}
+
+gint ci_spool_compare_index(gconstpointer a, gconstpointer b)
+{
+    guint x = ((const struct CISpoolSegment *)a)->index;
+    guint y = ((const struct CISpoolSegment *)b)->index;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+gboolean ci_spool_open(const gchar *path, gsize segment_size, guint sync_interval)
+{
+    g_return_val_if_fail(ci_spool.path == NULL, FALSE);
+
+    if (path == NULL || path[0] == 0)
+        return FALSE;
+
+    gchar *dirname = g_path_get_dirname(path);
+    gchar *basename = g_path_get_basename(path);
+    GDir *dir = g_dir_open(dirname, 0, NULL);
+    const gchar *name;
+    gchar *end;
+    guint64 index;
+    struct CISpoolSegment *segment;
+
+    ci_spool.path = g_strdup(path);
+    ci_spool.segment_size = MAX(segment_size, 4096);
+
+    /* segments left by the previous run */
+    while (dir != NULL && (name = g_dir_read_name(dir)) != NULL) {
+        if (!g_str_has_prefix(name, basename) || name[strlen(basename)] != '.')
+            continue;
+        index = g_ascii_strtoull(name + strlen(basename) + 1, &end, 10);
+        if (*end != 0 || end == name + strlen(basename) + 1 || index > G_MAXUINT)
+            continue;
+        if ((segment = ci_spool_segment_open((guint)index, FALSE)) == NULL)
+            continue;
+        ci_spool.segments = g_list_insert_sorted(ci_spool.segments, segment, ci_spool_compare_index);
+    }
+    if (dir != NULL)
+        g_dir_close(dir);
+    g_free(dirname);
+    g_free(basename);
+
+    GList *tmp;
+    for (tmp = ci_spool.segments; tmp != NULL; tmp = g_list_next(tmp))
+        ci_spool_segment_scan((struct CISpoolSegment *)tmp->data);
+    ci_spool_release_segments();
+
+    ci_spool.syncer = g_thread_pool_new(ci_spool_sync_func, NULL, 1, FALSE, NULL);
+    if (sync_interval > 0)
+        ci_spool.sync_source = g_timeout_add(sync_interval, ci_spool_sync_cb, NULL);
+    ci_spool.compact_source = g_timeout_add_seconds(CI_SPOOL_COMPACT_INTERVAL, ci_spool_compact_cb, NULL);
+
+    return TRUE;
+}
+
+gboolean ci_spool_is_open(void)
+{
+    return ci_spool.path != NULL;
+}
+
+void ci_spool_replay(CISpoolReplayCallback callback, gpointer userdata)
+{
+    GList *replay = ci_spool.replay;
+    GList *tmp;
+    CISpoolEntry *entry;
+    GHashTable *values;
+    const gchar *payload, *end, *server, *service, *key;
+
+    ci_spool.replay = NULL;
+
+    for (tmp = replay; tmp != NULL; tmp = g_list_next(tmp)) {
+        entry = (CISpoolEntry *)tmp->data;
+        payload = (const gchar *)ci_spool_record_header(entry->segment, entry->offset) + CI_SPOOL_HEADER_SIZE;
+        end = payload + ci_spool_record_header(entry->segment, entry->offset)[2];
+
+        /* strings are NUL-terminated, but do not trust the file */
+        if (end == payload || end[-1] != 0) {
+            ci_spool_done(entry);
+            continue;
+        }
+
+        server = payload;
+        service = server + strlen(server) + 1;
+        values = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+        for (key = service + strlen(service) + 1; key < end; key += strlen(key) + 1) {
+            if (key + strlen(key) + 1 >= end)
+                break;
+            g_hash_table_insert(values, g_strdup(key), g_strdup(key + strlen(key) + 1));
+            key += strlen(key) + 1;
+        }
+
+        if (callback)
+            callback(entry, server, service, values, userdata);
+        else
+            ci_spool_done(entry);
+        g_hash_table_destroy(values);
+    }
+
+    g_list_free(replay);
+}
+
+void ci_spool_close(void)
+{
+    if (ci_spool.path == NULL)
+        return;
+
+    if (ci_spool.sync_source)
+        g_source_remove(ci_spool.sync_source);
+    if (ci_spool.compact_source)
+        g_source_remove(ci_spool.compact_source);
+    ci_spool.sync_source = 0;
+    ci_spool.compact_source = 0;
+
+    /* wait for outstanding syncs */
+    g_thread_pool_free(ci_spool.syncer, FALSE, TRUE);
+    ci_spool.syncer = NULL;
+
+    g_list_free(ci_spool.replay);
+    ci_spool.replay = NULL;
+
+    /* unfinished records stay on disk for the next run */
+    ci_spool_release_segments();
+    GList *tmp;
+    struct CISpoolSegment *segment;
+    for (tmp = ci_spool.segments; tmp != NULL; tmp = g_list_next(tmp)) {
+        segment = (struct CISpoolSegment *)tmp->data;
+        ci_spool_segment_free(segment, segment->entries.length == 0);
+    }
+    g_list_free(ci_spool.segments);
+    ci_spool.segments = NULL;
+
+    g_free(ci_spool.path);
+    ci_spool.path = NULL;
+}
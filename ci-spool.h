@@ -0,0 +1,31 @@
+#ifndef __CI_SPOOL_H__
+#define __CI_SPOOL_H__
+
+#include <glib.h>
+
+/* calls handed to a service, kept on disk until the service is done with them,
+ * so they can be run again after a crash */
+typedef struct CISpoolEntry CISpoolEntry;
+
+/* path: prefix of the segment files (path.0, path.1, …), segment_size in bytes,
+ * sync_interval in milliseconds between syncs to disk (0: only on close);
+ * unfinished records of a previous run are kept for ci_spool_replay */
+gboolean ci_spool_open(const gchar *path, gsize segment_size, guint sync_interval);
+void ci_spool_close(void);
+
+gboolean ci_spool_is_open(void);
+
+/* n_values placeholders and their values (may be NULL);
+ * returns NULL if the spool is not open or the record does not fit */
+CISpoolEntry *ci_spool_append(const gchar *server, const gchar *service,
+                              const gchar * const *keys, const gchar * const *values, guint n_values);
+/* the call has been handled, entry is freed; entry may be NULL */
+void ci_spool_done(CISpoolEntry *entry);
+
+/* server, service, values, userdata; the callback owns the entry and must pass it to ci_spool_done
+ * eventually; values are freed after the callback returns */
+typedef void (*CISpoolReplayCallback)(CISpoolEntry *, const gchar *, const gchar *, GHashTable *, gpointer);
+/* hand all records left unfinished by the previous run to callback */
+void ci_spool_replay(CISpoolReplayCallback callback, gpointer userdata);
+
+#endif
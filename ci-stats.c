@@ -0,0 +1,145 @@
+#include "ci-stats.h"
+
+/* bucket i holds latencies in [2^i, 2^(i+1)) microseconds, bucket 0 also takes 0 */
+#define CI_STATS_BUCKETS 32
+
+struct CIStatsHistogram {
+    guint64 count;
+    guint64 sum;
+    guint64 max;
+    guint64 buckets[CI_STATS_BUCKETS];
+};
+
+struct CIStats {
+    gint ref;
+    guint64 counters[CIStatsCounterCount];
+    struct CIStatsHistogram latencies[CIStatsLatencyCount];
+};
+
+const gchar *ci_stats_counter_names[CIStatsCounterCount] = {
+    "rings", "calls", "queries", "cache-hits", "coalesced", "spawned",
+    "spawn-failed", "exited-ok", "exited-error", "dropped", "killed", "query-timeouts",
+    "prefetches", "duplicates", "rate-limited", "summaries",
+    "write-failed"
+};
+
+const gchar *ci_stats_latency_names[CIStatsLatencyCount] = {
+    "query", "expand", "queue", "spawn", "dispatch", "run"
+};
+
+CIStats *ci_stats_global = NULL;
+
+CIStats *ci_stats_new(void)
+{
+    CIStats *stats = g_malloc0(sizeof(struct CIStats));
+    stats->ref = 1;
+    return stats;
+}
+
+CIStats *ci_stats_ref(CIStats *stats)
+{
+    g_return_val_if_fail(stats != NULL, NULL);
+
+    ++stats->ref;
+    return stats;
+}
+
+void ci_stats_unref(CIStats *stats)
+{
+    if (stats != NULL && --stats->ref == 0)
+        g_free(stats);
+}
+
+CIStats *ci_stats_get_global(void)
+{
+    if (ci_stats_global == NULL)
+        ci_stats_global = ci_stats_new();
+    return ci_stats_global;
+}
+
+void ci_stats_count(CIStats *stats, CIStatsCounter counter)
+{
+    g_return_if_fail(stats != NULL && counter < CIStatsCounterCount);
+
+    ++stats->counters[counter];
+}
+
+guint64 ci_stats_get_count(CIStats *stats, CIStatsCounter counter)
+{
+    g_return_val_if_fail(stats != NULL && counter < CIStatsCounterCount, 0);
+
+    return stats->counters[counter];
+}
+
+void ci_stats_record(CIStats *stats, CIStatsLatency latency, gint64 start, gint64 end)
+{
+    g_return_if_fail(stats != NULL && latency < CIStatsLatencyCount);
+
+    if (start <= 0 || end < start)
+        return;
+
+    struct CIStatsHistogram *hist = &stats->latencies[latency];
+    guint64 value = end - start;
+    guint bucket = 0;
+
+    while (bucket < CI_STATS_BUCKETS - 1 && (value >> (bucket + 1)) != 0)
+        ++bucket;
+
+    ++hist->count;
+    hist->sum += value;
+    if (value > hist->max)
+        hist->max = value;
+    ++hist->buckets[bucket];
+}
+
+/* upper bound of the bucket containing the given quantile */
+guint64 ci_stats_histogram_quantile(struct CIStatsHistogram *hist, gdouble quantile)
+{
+    guint64 rank = (guint64)(quantile * hist->count);
+    guint64 seen = 0;
+    guint i;
+
+    for (i = 0; i < CI_STATS_BUCKETS; ++i) {
+        seen += hist->buckets[i];
+        if (seen > rank)
+            return MIN(((guint64)1 << (i + 1)) - 1, hist->max);
+    }
+
+    return hist->max;
+}
+
+void ci_stats_dump(CIStats *stats, const gchar *name, GString *out)
+{
+    g_return_if_fail(stats != NULL && out != NULL);
+
+    guint i;
+    struct CIStatsHistogram *hist;
+
+    g_string_append_printf(out, "[%s]\n", name ? name : "<cmdline>");
+    for (i = 0; i < CIStatsCounterCount; ++i) {
+        if (stats->counters[i] != 0)
+            g_string_append_printf(out, "  %s: %" G_GUINT64_FORMAT "\n",
+                    ci_stats_counter_names[i], stats->counters[i]);
+    }
+
+    for (i = 0; i < CIStatsLatencyCount; ++i) {
+        hist = &stats->latencies[i];
+        if (hist->count == 0)
+            continue;
+        g_string_append_printf(out, "  latency %s (us): n=%" G_GUINT64_FORMAT
+                " mean=%" G_GUINT64_FORMAT " p50<=%" G_GUINT64_FORMAT
+                " p90<=%" G_GUINT64_FORMAT " p99<=%" G_GUINT64_FORMAT
+                " max=%" G_GUINT64_FORMAT "\n",
+                ci_stats_latency_names[i], hist->count, hist->sum / hist->count,
+                ci_stats_histogram_quantile(hist, 0.5),
+                ci_stats_histogram_quantile(hist, 0.9),
+                ci_stats_histogram_quantile(hist, 0.99),
+                hist->max);
+    }
+}
+
+void ci_stats_cleanup(void)
+{
+    ci_stats_unref(ci_stats_global);
+    ci_stats_global = NULL;
+}
@@ -0,0 +1,59 @@
+#ifndef __CI_STATS_H__
+#define __CI_STATS_H__
+
+#include <glib.h>
+
+typedef enum {
+    CIStatsRings = 0,
+    CIStatsCalls,
+    CIStatsQueries,
+    CIStatsCacheHits,
+    CIStatsCoalesced,
+    CIStatsSpawned,
+    CIStatsSpawnFailed,
+    CIStatsExitedOk,
+    CIStatsExitedError,
+    CIStatsDropped,
+    CIStatsKilled,
+    CIStatsQueryTimeouts,
+    CIStatsPrefetches,
+    CIStatsDuplicates,
+    CIStatsRateLimited,
+    CIStatsSummaries,
+    CIStatsWriteFailed,
+    CIStatsCounterCount
+} CIStatsCounter;
+
+/* latencies between the pipeline stages:
+ * ring received -> query sent -> reply received -> expansion done
+ *   -> spawn requested -> spawn done -> child exited */
+typedef enum {
+    CIStatsLatencyQuery = 0,   /* query sent -> reply received */
+    CIStatsLatencyExpand,      /* reply received -> expansion done */
+    CIStatsLatencyQueue,       /* expansion done -> spawn requested */
+    CIStatsLatencySpawn,       /* spawn requested -> spawn done */
+    CIStatsLatencyDispatch,    /* ring received -> spawn done (or handled in-process) */
+    CIStatsLatencyRun,         /* spawn done -> child exited */
+    CIStatsLatencyCount
+} CIStatsLatency;
+
+typedef struct CIStats CIStats;
+
+CIStats *ci_stats_new(void);
+/* a service replaced on reload shares its stats with the replacement */
+CIStats *ci_stats_ref(CIStats *stats);
+void ci_stats_unref(CIStats *stats);
+
+/* rings, cache and query counters not bound to a service */
+CIStats *ci_stats_get_global(void);
+
+void ci_stats_count(CIStats *stats, CIStatsCounter counter);
+guint64 ci_stats_get_count(CIStats *stats, CIStatsCounter counter);
+/* start and end are g_get_monotonic_time() values; ignored if start is 0 */
+void ci_stats_record(CIStats *stats, CIStatsLatency latency, gint64 start, gint64 end);
+
+void ci_stats_dump(CIStats *stats, const gchar *name, GString *out);
+
+void ci_stats_cleanup(void);
+
+#endif
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <signal.h>
 #include "daemon.h"
 
 pid_t _daemon_pid = -1;
@@ -89,3 +90,25 @@ int stop_daemon(void)
     }
     return 0;
 }
+
+pid_t read_daemon_pid(char *pidfile)
+{
+    FILE *f = NULL;
+    char buffer[256];
+    unsigned long int pid;
+
+    if (pidfile == NULL || (f = fopen(pidfile, "r")) == NULL)
+        return -1;
+
+    if (fgets(buffer, 256, f) == NULL) {
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+
+    pid = strtoul(buffer, NULL, 10);
+    if (pid == 0 || kill((pid_t)pid, 0) != 0)
+        return -1;
+
+    return (pid_t)pid;
+}
@@ -5,5 +5,6 @@
 
 pid_t start_daemon(const char *comm, char *pidfile);
 int stop_daemon(void);
+pid_t read_daemon_pid(char *pidfile);
 
 #endif
@@ -0,0 +1,47 @@
+/* Example plugin service, appends one line per call like testscript.sh.
+ *
+ * gcc -shared -fPIC -o liblogplugin.so logplugin.c `pkg-config --cflags --libs glib-2.0` -I..
+ *
+ * [logplugin]
+ * plugin = ./liblogplugin.so
+ * file = test.log
+ */
+#include <stdio.h>
+#include "ci-plugin.h"
+
+G_MODULE_EXPORT guint ci_plugin_get_abi_version(void)
+{
+    return CI_PLUGIN_ABI_VERSION;
+}
+
+G_MODULE_EXPORT gboolean ci_plugin_init(const gchar *identifier, const gchar * const *options,
+                                        gpointer *plugin_data)
+{
+    const gchar *filename = "test.log";
+    guint i;
+
+    for (i = 0; options && options[i] != NULL && options[i + 1] != NULL; i += 2) {
+        if (g_strcmp0(options[i], "file") == 0)
+            filename = options[i + 1];
+    }
+
+    FILE *f = fopen(filename, "a");
+    if (f == NULL)
+        return FALSE;
+
+    *plugin_data = f;
+    return TRUE;
+}
+
+G_MODULE_EXPORT void ci_plugin_handle_call(const CIPluginCall *call, gpointer plugin_data)
+{
+    fprintf((FILE *)plugin_data, "Neuer Anruf von (%s) %s (%s) %s an %s (%s) am %s um %s\n",
+            call->areacode, call->number, call->area, call->name,
+            call->msn, call->alias, call->date, call->time);
+    fflush((FILE *)plugin_data);
+}
+
+G_MODULE_EXPORT void ci_plugin_cleanup(gpointer plugin_data)
+{
+    fclose((FILE *)plugin_data);
+}
@@ -6,14 +6,16 @@ NUMBER=""
 AREA=""
 AREACODE=""
 NAME=""
+DATE=""
 TIME=""
 MSN=""
 SERVICE=""
 ALIAS=""
 FIX=""
+BATCH=""
 
-TEMP=`getopt -o n:a:A:N:t:m:s:r:f: --long \
-	number:,area:,areacode:,name:,time:,msn:,service:,alias:,fix:,account:,sendto: \
+TEMP=`getopt -o n:a:A:N:d:t:m:s:r:f:b --long \
+	number:,area:,areacode:,name:,date:,time:,msn:,service:,alias:,fix:,account:,sendto:,batch \
 	-n '$0' -- "$@"`
 
 if [ $? != 0 ] ; then echo "Error parsing options" >&2 ; exit 1 ; fi
@@ -27,6 +29,7 @@ do
                 -a|--area) AREA=$2 ; shift 2;;
                 -A|--areacode) AREACODE=$2 ; shift 2;;
                 -N|--name) NAME=$2 ; shift 2;;
+                -d|--date) DATE=$2 ; shift 2;;
                 -t|--time) TIME=$2 ; shift 2;;
                 -m|--msn) MSN=$2 ; shift 2;;
                 -s|--service) SERVICE=$2 ; shift 2;;
@@ -34,12 +37,13 @@ do
                 -f|--fix) FIX=$2 ; shift 2;;
 		--account) ACCOUNT=$2; shift 2;;
 		--sendto) SENDTO=$2; shift 2;;
+                -b|--batch) BATCH=1 ; shift;;
 		--) shift; break ;;
 		*) echo "Internal error (found $1)" >&2 ; exit 1;;
         esac
 done
 
-zeit=$(date -d "${TIME}" +"am %A, %d. %B %Y um %H:%M:%S")
+zeit="am ${DATE} um ${TIME}"
 
 if [ -z $SENDTO ]
 then
@@ -47,6 +51,19 @@ then
 	exit 1;
 fi
 
+if [ -n "$BATCH" ]
+then
+	# one tab-separated record per call on stdin:
+	# completenumber number areacode area name date time msn alias
+	CALLS=$(awk -F '\t' '{ printf "  %s %s: (%s) %s (%s) %s an %s (%s)\n", $6, $7, $3, $2, $4, $5, $8, $9 }')
+	COUNT=$(echo "$CALLS" | wc -l)
+
+	echo "${COUNT} neue Anrufe
+
+${CALLS}" | mailx -s "${COUNT} neue Anrufe" -a "Content-Type: text/plain; charset=UTF-8" ${SENDTO} -- --account=${ACCOUNT}
+	exit 0
+fi
+
 echo "Neuer Anruf von
 
   (${AREACODE}) ${NUMBER} ($AREA)
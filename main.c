@@ -5,10 +5,34 @@
 #include "ci-config.h"
 #include <ci-client.h>
 #include "ci-service.h"
+#include "ci-caller-cache.h"
+#include "ci-dedup.h"
+#include "ci-spool.h"
+#include "ci-spawner.h"
+#include "ci-stats.h"
+#include "ci-control.h"
 #include "daemon.h"
 #include <stdio.h>
+#include <signal.h>
+#include <glib/gstdio.h>
 
-CIClient *ci_client = NULL;
+#define CI_MAIN_MAX_SERVERS CI_CONFIG_MAX_SERVERS
+
+/* one connection per configured server */
+struct _CIMainServer {
+    gchar *name;
+    CIClient *client;
+};
+
+struct _CIMainServer ci_main_servers[CI_MAIN_MAX_SERVERS];
+guint ci_main_n_servers = 0;
+/* the spool is replayed once a server can take the queries */
+gboolean ci_main_replay_pending = FALSE;
+
+/* key: "server:userid:completenumber", value: struct _CIMainServiceQuery * */
+GHashTable *ci_main_pending_queries = NULL;
+guint ci_main_query_sweep_source = 0;
+guint ci_main_next_query = 1;
 
 gboolean ci_main_handle_signal(GMainLoop *mainloop)
 {
@@ -16,23 +40,200 @@ gboolean ci_main_handle_signal(GMainLoop *mainloop)
     return FALSE;
 }
 
+gboolean ci_main_handle_reload_signal(gpointer userdata)
+{
+    ci_config_reload();
+    return TRUE;
+}
+
+gchar *ci_main_get_stats(void)
+{
+    GString *out = g_string_new(NULL);
+
+    ci_stats_dump(ci_stats_get_global(), "ciservice", out);
+    ci_service_dump_stats(out);
+
+    return g_string_free(out, FALSE);
+}
+
+/* write statistics to the stats file, or to stderr if there is none */
+gboolean ci_main_handle_stats_signal(gpointer userdata)
+{
+    gchar *stats = ci_main_get_stats();
+    gchar *statsfile = NULL;
+
+    if (!ci_config_get("statsfile", &statsfile) || statsfile == NULL ||
+            !g_file_set_contents(statsfile, stats, -1, NULL))
+        fputs(stats, stderr);
+
+    g_free(statsfile);
+    g_free(stats);
+
+    return TRUE;
+}
+
 void ci_main_cleanup(gboolean full)
 {
     ci_config_cleanup();
     ci_service_cleanup();
+    /* after the services, calls they did not finish stay in the spool */
+    ci_spool_close();
+    ci_caller_cache_cleanup();
+    ci_dedup_cleanup();
+    ci_stats_cleanup();
+
+    if (ci_main_pending_queries != NULL) {
+        if (ci_main_query_sweep_source)
+            g_source_remove(ci_main_query_sweep_source);
+        ci_main_query_sweep_source = 0;
+        g_hash_table_destroy(ci_main_pending_queries);
+        ci_main_pending_queries = NULL;
+    }
 
     /* the following is only needed in the daemon */
     if (!full)
         return;
 
-    if (ci_client != NULL) {
-        ci_client_disconnect(ci_client);
-        ci_client_shutdown(ci_client);
+    guint i;
+    for (i = 0; i < ci_main_n_servers; ++i) {
+        ci_client_disconnect(ci_main_servers[i].client);
+        ci_client_shutdown(ci_main_servers[i].client);
+        g_free(ci_main_servers[i].name);
     }
+    ci_main_n_servers = 0;
+
+    ci_spawner_stop();
+    ci_control_stop();
 
     stop_daemon();
 }
 
+/* send a command to the running daemon and print its output */
+gboolean ci_main_send_control(const gchar *command)
+{
+    gchar *path = NULL;
+    GString *reply = g_string_new(NULL);
+    gboolean result;
+
+    ci_config_get("controlsocket", &path);
+    if (path == NULL) {
+        fprintf(stderr, "No control socket configured.\n");
+        g_string_free(reply, TRUE);
+        return FALSE;
+    }
+
+    result = ci_control_send(path, command, reply);
+    fputs(reply->str, stdout);
+
+    g_string_free(reply, TRUE);
+    g_free(path);
+    return result;
+}
+
+/* ask the running daemon for its statistics and print them; via the control socket,
+ * or SIGUSR1 and the stats file if there is none */
+gboolean ci_main_print_stats(void)
+{
+    gchar *pidfile = NULL;
+    gchar *statsfile = NULL;
+    gchar *control_socket = NULL;
+    gchar *contents = NULL;
+    GStatBuf before, after;
+    gboolean had_file;
+    gboolean updated = FALSE;
+    gboolean result = FALSE;
+    pid_t pid;
+    guint i;
+
+    ci_config_get("pidfile", &pidfile);
+    ci_config_get("statsfile", &statsfile);
+    ci_config_get("controlsocket", &control_socket);
+
+    if ((pid = read_daemon_pid(pidfile)) == -1) {
+        fprintf(stderr, "Daemon is not running.\n");
+        goto done;
+    }
+    if (control_socket != NULL) {
+        result = ci_main_send_control("stats");
+        goto done;
+    }
+    if (statsfile == NULL) {
+        fprintf(stderr, "No stats file configured.\n");
+        goto done;
+    }
+
+    had_file = g_stat(statsfile, &before) == 0;
+    if (kill(pid, SIGUSR1) != 0) {
+        fprintf(stderr, "Could not signal daemon.\n");
+        goto done;
+    }
+
+    /* the file is replaced atomically, wait for a new one */
+    for (i = 0; i < 40 && !updated; ++i) {
+        g_usleep(50000);
+        updated = g_stat(statsfile, &after) == 0 &&
+                (!had_file || after.st_ino != before.st_ino || after.st_mtime != before.st_mtime);
+    }
+    if (!updated) {
+        fprintf(stderr, "Daemon did not write `%s'.\n", statsfile);
+        goto done;
+    }
+
+    if (!g_file_get_contents(statsfile, &contents, NULL, NULL)) {
+        fprintf(stderr, "Could not read `%s'.\n", statsfile);
+        goto done;
+    }
+    fputs(contents, stdout);
+    result = TRUE;
+
+done:
+    g_free(contents);
+    g_free(control_socket);
+    g_free(statsfile);
+    g_free(pidfile);
+    return result;
+}
+
+/* hand services from the command line to the running daemon */
+gboolean ci_main_forward_services(void)
+{
+    gchar **commands = NULL;
+    gchar **services = NULL;
+    gchar *command;
+    gboolean result = TRUE;
+    guint i;
+
+    ci_config_get("commands", &commands);
+    ci_config_get("services", &services);
+
+    for (i = 0; commands != NULL && commands[i] != NULL; ++i) {
+        command = g_strconcat("add ", commands[i], NULL);
+        result = ci_main_send_control(command) && result;
+        g_free(command);
+    }
+    for (i = 0; services != NULL && services[i] != NULL; ++i) {
+        command = g_strconcat("activate ", services[i], NULL);
+        result = ci_main_send_control(command) && result;
+        g_free(command);
+    }
+
+    g_strfreev(commands);
+    g_strfreev(services);
+    return result;
+}
+
+gboolean ci_main_daemon_running(void)
+{
+    gchar *pidfile = NULL;
+    pid_t pid;
+
+    ci_config_get("pidfile", &pidfile);
+    pid = read_daemon_pid(pidfile);
+    g_free(pidfile);
+
+    return pid != -1;
+}
+
 void ci_main_list_services(void)
 {
     GList *services = ci_service_list_services();
@@ -52,48 +253,333 @@ void ci_main_print_version(void)
     fprintf(stdout, "%s - %s\n", APPNAME, VERSION);
 }
 
-struct _CIMainServiceQuery {
+struct _CIMainQueryWaiter {
     CIServiceQueryCompleteCallback complete_cb;
     gpointer servicedata;
 };
 
-void ci_main_service_query_caller_reply_cb(CINetMsg *msg, struct _CIMainServiceQuery *querydata)
+/* seconds after which new callers stop joining an unanswered query and ask again */
+#define CI_MAIN_QUERY_STALE 30
+
+/* one outstanding server query, shared by all services asking for the same caller */
+struct _CIMainServiceQuery {
+    guint id;   /* passed to the client library instead of a pointer, a late reply may find it gone */
+    gchar *key;
+    struct _CIMainServer *server;
+    gint userid;
+    gchar *completenumber;
+    gint64 query_time;
+    GSList *waiters; /* [element-type: struct _CIMainQueryWaiter *] */
+};
+
+void ci_main_service_query_free(struct _CIMainServiceQuery *querydata)
 {
-    /* run complete cb (msg gets freed by client lib), free querydata */
-    if (msg->msgtype != CI_NET_MSG_DB_GET_CALLER)
-        goto done;
+    if (querydata == NULL)
+        return;
+    g_slist_free_full(querydata->waiters, g_free);
+    g_free(querydata->completenumber);
+    g_free(querydata->key);
+    g_free(querydata);
+}
+
+/* remove from the pending queries, run the complete cbs of all waiters and free querydata;
+ * name NULL: the waiters use the name from the call info */
+void ci_main_service_query_finish(struct _CIMainServiceQuery *querydata, const gchar *name)
+{
+    g_hash_table_steal(ci_main_pending_queries, querydata->key);
+
+    GSList *tmp;
+    struct _CIMainQueryWaiter *waiter;
+    querydata->waiters = g_slist_reverse(querydata->waiters);
+    for (tmp = querydata->waiters; tmp != NULL; tmp = g_slist_next(tmp)) {
+        waiter = (struct _CIMainQueryWaiter *)tmp->data;
+        if (waiter->complete_cb)
+            waiter->complete_cb(name, waiter->servicedata);
+    }
 
-    gchar *name = g_strdup(((CINetMsgDbGetCaller*)msg)->caller.name);
-    if (querydata && querydata->complete_cb)
-        querydata->complete_cb(name, querydata->servicedata);
+    ci_main_service_query_free(querydata);
+}
+
+gboolean ci_main_service_query_match_id(gpointer key, struct _CIMainServiceQuery *querydata, gpointer id)
+{
+    return querydata->id == GPOINTER_TO_UINT(id);
+}
+
+void ci_main_service_query_caller_reply_cb(CINetMsg *msg, gpointer id)
+{
+    /* msg gets freed by client lib; a query given up as stale is no longer in the table */
+    struct _CIMainServiceQuery *querydata = NULL;
+    if (ci_main_pending_queries)
+        querydata = g_hash_table_find(ci_main_pending_queries,
+                (GHRFunc)ci_main_service_query_match_id, id);
+    if (querydata == NULL)
+        return;
+
+    gchar *name = NULL;
+    if (msg && msg->msgtype == CI_NET_MSG_DB_GET_CALLER) {
+        name = g_strdup(((CINetMsgDbGetCaller*)msg)->caller.name);
+        ci_caller_cache_insert(querydata->server->name, querydata->userid, querydata->completenumber, name);
+    }
+
+    ci_main_service_query_finish(querydata, name);
     g_free(name);
+}
 
-done:
-    g_free(querydata);
+gboolean ci_main_service_query_is_stale(gpointer key, struct _CIMainServiceQuery *querydata, gpointer now)
+{
+    return *(gint64 *)now - querydata->query_time > CI_MAIN_QUERY_STALE * G_USEC_PER_SEC;
 }
 
-void ci_main_service_query_caller_cb(const gchar *completenumber, gint userid, gpointer userdata,
-                                     CIServiceQueryCompleteCallback complete_cb, gpointer servicedata)
+/* give up on queries without a reply; their waiters run with the name from the call info */
+gboolean ci_main_service_query_sweep_cb(gpointer userdata)
+{
+    gint64 now = g_get_monotonic_time();
+    struct _CIMainServiceQuery *querydata;
+
+    while ((querydata = g_hash_table_find(ci_main_pending_queries,
+                    (GHRFunc)ci_main_service_query_is_stale, &now)) != NULL)
+        ci_main_service_query_finish(querydata, NULL);
+
+    return TRUE;
+}
+
+void ci_main_service_query_init(void)
+{
+    if (ci_main_pending_queries != NULL)
+        return;
+    ci_main_pending_queries = g_hash_table_new_full(g_str_hash, g_str_equal,
+            NULL, (GDestroyNotify)ci_main_service_query_free);
+    ci_main_query_sweep_source = g_timeout_add_seconds(CI_MAIN_QUERY_STALE,
+            ci_main_service_query_sweep_cb, NULL);
+}
+
+gchar *ci_main_service_query_make_key(struct _CIMainServer *server, gint userid, const gchar *completenumber)
+{
+    return g_strdup_printf("%s:%d:%s", server->name, userid, completenumber ? completenumber : "");
+}
+
+/* a service stopped waiting for the reply */
+void ci_main_service_query_cancel_cb(const gchar *completenumber, gint userid, gpointer userdata,
+                                     gpointer servicedata)
+{
+    struct _CIMainServer *server = (struct _CIMainServer *)userdata;
+    struct _CIMainServiceQuery *querydata;
+    GSList *tmp;
+
+    if (ci_main_pending_queries == NULL || server == NULL)
+        return;
+
+    gchar *key = ci_main_service_query_make_key(server, userid, completenumber);
+    querydata = g_hash_table_lookup(ci_main_pending_queries, key);
+    g_free(key);
+    if (querydata == NULL)
+        return;
+
+    for (tmp = querydata->waiters; tmp != NULL; tmp = g_slist_next(tmp)) {
+        if (((struct _CIMainQueryWaiter *)tmp->data)->servicedata == servicedata) {
+            g_free(tmp->data);
+            querydata->waiters = g_slist_delete_link(querydata->waiters, tmp);
+            return;
+        }
+    }
+}
+
+/* takes ownership of key; waiter may be NULL */
+void ci_main_service_query_start(gchar *key, struct _CIMainServer *server, gint userid,
+                                 const gchar *completenumber, struct _CIMainQueryWaiter *waiter)
 {
-    /* query data and pass callback via _CIMainServiceQuery to reply cb */
+    /* query data and pass callbacks via _CIMainServiceQuery to reply cb */
     struct _CIMainServiceQuery *querydata = g_malloc0(sizeof(struct _CIMainServiceQuery));
-    querydata->complete_cb = complete_cb;
-    querydata->servicedata = servicedata;
+    querydata->id = ci_main_next_query++;
+    if (ci_main_next_query == 0)
+        ci_main_next_query = 1;
+    querydata->key = key;
+    querydata->server = server;
+    querydata->userid = userid;
+    querydata->completenumber = g_strdup(completenumber);
+    querydata->query_time = g_get_monotonic_time();
+    if (waiter != NULL)
+        querydata->waiters = g_slist_prepend(NULL, waiter);
+    g_hash_table_insert(ci_main_pending_queries, querydata->key, querydata);
 
-    ci_client_query(ci_client, CIClientQueryGetCaller,
-                    (CIQueryMsgCallback)ci_main_service_query_caller_reply_cb, (gpointer)querydata,
+    ci_stats_count(ci_stats_get_global(), CIStatsQueries);
+    /* ask the server the call came from */
+    ci_client_query(server->client, CIClientQueryGetCaller,
+                    (CIQueryMsgCallback)ci_main_service_query_caller_reply_cb, GUINT_TO_POINTER(querydata->id),
                     "user", GINT_TO_POINTER(userid),
                     "number", completenumber,
                     NULL, NULL);
 }
 
-void ci_main_handle_message(CINetMsg *msg)
+void ci_main_service_query_caller_cb(const gchar *completenumber, gint userid, gpointer userdata,
+                                     CIServiceQueryCompleteCallback complete_cb, gpointer servicedata)
+{
+    struct _CIMainServer *server = (struct _CIMainServer *)userdata;
+
+    /* answer from the cache without a server round-trip if possible */
+    gchar *name = NULL;
+    if (ci_caller_cache_lookup(server->name, userid, completenumber, &name)) {
+        ci_stats_count(ci_stats_get_global(), CIStatsCacheHits);
+        if (complete_cb)
+            complete_cb(name, servicedata);
+        g_free(name);
+        return;
+    }
+
+    struct _CIMainQueryWaiter *waiter = g_malloc0(sizeof(struct _CIMainQueryWaiter));
+    waiter->complete_cb = complete_cb;
+    waiter->servicedata = servicedata;
+
+    ci_main_service_query_init();
+
+    /* join an outstanding query for the same caller */
+    gchar *key = ci_main_service_query_make_key(server, userid, completenumber);
+    struct _CIMainServiceQuery *querydata = g_hash_table_lookup(ci_main_pending_queries, key);
+    if (querydata != NULL &&
+            g_get_monotonic_time() - querydata->query_time > CI_MAIN_QUERY_STALE * G_USEC_PER_SEC) {
+        /* the reply may never come; a late one is dropped */
+        ci_main_service_query_finish(querydata, NULL);
+        querydata = NULL;
+    }
+    if (querydata != NULL) {
+        querydata->waiters = g_slist_prepend(querydata->waiters, waiter);
+        ci_stats_count(ci_stats_get_global(), CIStatsCoalesced);
+        g_free(key);
+        return;
+    }
+
+    ci_main_service_query_start(key, server, userid, completenumber, waiter);
+}
+
+/* look up the caller while the ring is still being transferred; the result ends up
+ * in the cache or is joined by the services when the ring is complete */
+void ci_main_prefetch_caller_cb(const gchar *completenumber, gint userid, gpointer userdata,
+                                CIServiceQueryCompleteCallback complete_cb, gpointer servicedata)
+{
+    struct _CIMainServer *server = (struct _CIMainServer *)userdata;
+
+    gchar *name = NULL;
+    if (ci_caller_cache_lookup(server->name, userid, completenumber, &name)) {
+        g_free(name);
+        return;
+    }
+
+    ci_main_service_query_init();
+
+    gchar *key = ci_main_service_query_make_key(server, userid, completenumber);
+    if (g_hash_table_lookup(ci_main_pending_queries, key) != NULL) {
+        g_free(key);
+        return;
+    }
+
+    ci_stats_count(ci_stats_get_global(), CIStatsPrefetches);
+    ci_main_service_query_start(key, server, userid, completenumber, NULL);
+}
+
+void ci_main_handle_message(struct _CIMainServer *server, CINetMsg *msg)
 {
     if (msg == NULL)
         return;
-    if (msg->msgtype == CI_NET_MSG_EVENT_RING &&
-            ((CINetMsgMultipart*)msg)->stage == MultipartStageComplete) {
-        ci_service_run_commands(&((CINetMsgEventRing*)msg)->callinfo, ci_main_service_query_caller_cb, NULL);
+    if (msg->msgtype != CI_NET_MSG_EVENT_RING)
+        return;
+
+    CICallInfo *callinfo = &((CINetMsgEventRing*)msg)->callinfo;
+    if (((CINetMsgMultipart*)msg)->stage == MultipartStageComplete) {
+        /* exchanges may send the same call again, e.g. after a reconnect */
+        if (ci_dedup_check(server->name, callinfo)) {
+            ci_stats_count(ci_stats_get_global(), CIStatsDuplicates);
+            return;
+        }
+        ci_service_run_commands(server->name, callinfo, ci_main_service_query_caller_cb, server);
+    }
+    else if (callinfo->completenumber && callinfo->completenumber[0]) {
+        /* the number is known before the ring is complete */
+        ci_service_prefetch(server->name, callinfo, ci_main_prefetch_caller_cb, server);
+    }
+}
+
+/* calls from servers no longer configured are replayed for the first one */
+void ci_main_replay_call(CISpoolEntry *entry, const gchar *servername, const gchar *service,
+                         GHashTable *values, gpointer userdata)
+{
+    struct _CIMainServer *server = NULL;
+    guint i;
+
+    for (i = 0; i < ci_main_n_servers && server == NULL; ++i) {
+        if (g_strcmp0(ci_main_servers[i].name, servername) == 0)
+            server = &ci_main_servers[i];
+    }
+    if (server == NULL && ci_main_n_servers > 0)
+        server = &ci_main_servers[0];
+
+    ci_service_replay(entry, server ? server->name : servername, service, values,
+            server ? ci_main_service_query_caller_cb : NULL, server);
+}
+
+void ci_main_handle_state(struct _CIMainServer *server, CIClientState state)
+{
+    if (state != CIClientStateConnected || !ci_main_replay_pending)
+        return;
+
+    ci_main_replay_pending = FALSE;
+    ci_spool_replay(ci_main_replay_call, NULL);
+}
+
+/* the client library passes no user data to callbacks, so each server gets its own;
+ * one per CI_MAIN_MAX_SERVERS */
+#define CI_MAIN_SERVER_HANDLER(n) \
+    void ci_main_handle_message_##n(CINetMsg *msg) \
+    { \
+        ci_main_handle_message(&ci_main_servers[n], msg); \
+    } \
+    void ci_main_handle_state_##n(CIClientState state) \
+    { \
+        ci_main_handle_state(&ci_main_servers[n], state); \
+    }
+
+CI_MAIN_SERVER_HANDLER(0)
+CI_MAIN_SERVER_HANDLER(1)
+CI_MAIN_SERVER_HANDLER(2)
+CI_MAIN_SERVER_HANDLER(3)
+CI_MAIN_SERVER_HANDLER(4)
+CI_MAIN_SERVER_HANDLER(5)
+CI_MAIN_SERVER_HANDLER(6)
+CI_MAIN_SERVER_HANDLER(7)
+
+void (*ci_main_server_handlers[CI_MAIN_MAX_SERVERS])(CINetMsg *) = {
+    ci_main_handle_message_0, ci_main_handle_message_1,
+    ci_main_handle_message_2, ci_main_handle_message_3,
+    ci_main_handle_message_4, ci_main_handle_message_5,
+    ci_main_handle_message_6, ci_main_handle_message_7
+};
+
+void (*ci_main_server_state_handlers[CI_MAIN_MAX_SERVERS])(CIClientState) = {
+    ci_main_handle_state_0, ci_main_handle_state_1,
+    ci_main_handle_state_2, ci_main_handle_state_3,
+    ci_main_handle_state_4, ci_main_handle_state_5,
+    ci_main_handle_state_6, ci_main_handle_state_7
+};
+
+void ci_main_connect_servers(void)
+{
+    GList *tmp;
+    CIConfigServer *config;
+    struct _CIMainServer *server;
+
+    for (tmp = ci_config_get_servers(); tmp != NULL; tmp = g_list_next(tmp)) {
+        config = (CIConfigServer *)tmp->data;
+        if (ci_main_n_servers == CI_MAIN_MAX_SERVERS) {
+            fprintf(stderr, "Too many servers, ignoring `%s'.\n", config->name);
+            continue;
+        }
+        server = &ci_main_servers[ci_main_n_servers];
+        server->name = g_strdup(config->name);
+        server->client = ci_client_new_full(config->host, config->port,
+                ci_main_server_handlers[ci_main_n_servers],
+                ci_main_server_state_handlers[ci_main_n_servers]);
+        ci_client_set_retry_interval(server->client, config->retry_interval);
+        ci_client_connect(server->client);
+        ++ci_main_n_servers;
     }
 }
 
@@ -101,6 +587,9 @@ int main(int argc, char **argv)
 {
 #if !GLIB_CHECK_VERSION(2,36,0)
     g_type_init();
+#endif
+#if !GLIB_CHECK_VERSION(2,32,0)
+    g_thread_init(NULL);
 #endif
     if (!ci_config_load(&argc, &argv))
         return 1;
@@ -108,21 +597,42 @@ int main(int argc, char **argv)
     gboolean flag;
     pid_t daemon_pid;
     gchar *pidfile = NULL;
+    gchar *command = NULL;
 
     if (ci_config_get("print-version", &flag) && flag) {
         ci_main_print_version();
         goto done;
     }
+    if (ci_config_get("control-command", &command) && command != NULL) {
+        flag = ci_main_send_control(command);
+        g_free(command);
+        ci_main_cleanup(FALSE);
+        return flag ? 0 : 1;
+    }
     if (ci_config_get("list-services", &flag) && flag) {
-        ci_main_list_services();
+        /* show the live state if the daemon is running */
+        if (!ci_main_daemon_running() || !ci_main_send_control("list"))
+            ci_main_list_services();
         goto done;
     }
+    if (ci_config_get("print-stats", &flag) && flag) {
+        flag = ci_main_print_stats();
+        ci_main_cleanup(FALSE);
+        return flag ? 0 : 1;
+    }
     if (ci_config_get("daemonize", &flag) && flag &&
             ci_config_get("pidfile", &pidfile)) {
+        /* if daemon is already running, just add services via the control socket */
+        if (ci_main_daemon_running()) {
+            g_free(pidfile);
+            flag = ci_main_forward_services();
+            ci_main_cleanup(FALSE);
+            return flag ? 0 : 1;
+        }
+
         daemon_pid = start_daemon(argv[0], pidfile);
         g_free(pidfile);
 
-        /* TODO: if daemon is already running, just add services via ipc-socket */
         if (daemon_pid == -1) {
             fprintf(stderr, "Could not start daemon.\n");
             ci_main_cleanup(TRUE);
@@ -135,23 +645,62 @@ int main(int argc, char **argv)
         }
     }
 
-    gchar *host = NULL;
-    guint port;
-    gint retry_interval;
+    gint cache_size, cache_ttl, cache_negative_ttl;
+    gint dedup_window, dedup_size;
+    gint dispatch_threads;
+
+    ci_config_get("cache-size", &cache_size);
+    ci_config_get("cache-ttl", &cache_ttl);
+    ci_config_get("cache-negative-ttl", &cache_negative_ttl);
+
+    ci_config_get("dedup-window", &dedup_window);
+    ci_config_get("dedup-size", &dedup_size);
 
-    ci_config_get("hostname", &host);
-    ci_config_get("port", &port);
-    ci_config_get("retry-interval", &retry_interval);
+    ci_caller_cache_set_limits(cache_size, cache_ttl, cache_negative_ttl);
+    ci_service_set_query_cancel(ci_main_service_query_cancel_cb);
+    ci_dedup_set_window(dedup_window, dedup_size);
 
-    ci_client = ci_client_new_full(host, port, ci_main_handle_message, NULL);
-    ci_client_set_retry_interval(ci_client, retry_interval);
+    ci_config_get("dispatch-threads", &dispatch_threads);
+
+    /* fork the spawner while the process image is still small */
+    if (!ci_spawner_start())
+        fprintf(stderr, "Could not start spawner helper, spawning directly.\n");
+    /* threads only after the fork */
+    ci_service_set_dispatch_threads(dispatch_threads);
+    ci_service_start_monitors();
+
+    ci_main_connect_servers();
+
+    gchar *spool = NULL;
+    gint spool_segment_size, spool_sync_interval;
+    ci_config_get("spool", &spool);
+    ci_config_get("spool-segment-size", &spool_segment_size);
+    ci_config_get("spool-sync-interval", &spool_sync_interval);
+    if (spool != NULL && spool[0] != 0) {
+        /* the connections are not up yet, the first one to connect replays */
+        if (ci_spool_open(spool, (gsize)spool_segment_size, (guint)MAX(spool_sync_interval, 0))) {
+            if (ci_main_n_servers > 0)
+                ci_main_replay_pending = TRUE;
+            else
+                ci_spool_replay(ci_main_replay_call, NULL);
+        }
+        else
+            fprintf(stderr, "Could not open spool `%s'.\n", spool);
+    }
+    g_free(spool);
 
-    ci_client_connect(ci_client);
+    gchar *control_socket = NULL;
+    ci_config_get("controlsocket", &control_socket);
+    if (control_socket != NULL)
+        ci_control_start(control_socket);
+    g_free(control_socket);
 
     GMainLoop *mainloop = g_main_loop_new(NULL, FALSE);
 
     g_unix_signal_add(SIGINT, (GSourceFunc)ci_main_handle_signal, mainloop);
     g_unix_signal_add(SIGTERM, (GSourceFunc)ci_main_handle_signal, mainloop);
+    g_unix_signal_add(SIGUSR1, (GSourceFunc)ci_main_handle_stats_signal, NULL);
+    g_unix_signal_add(SIGHUP, (GSourceFunc)ci_main_handle_reload_signal, NULL);
 
     g_main_loop_run(mainloop);
 